@@ -1 +1,2 @@
 gcc-11 -static -O3 -march=native stream.c -o stream
+gcc-11 -static -O3 -march=native hugepage_stream.c -o hugepage_stream
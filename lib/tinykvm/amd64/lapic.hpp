@@ -6,6 +6,20 @@
 #define AMD64_APIC_MODE_EXTINT   0x7
 #define AMD64_APIC_MODE_NMI      0x4
 
+#define AMD64_APIC_BASE_ADDR     0xFEE00000
+#define AMD64_APIC_BASE_BSP      0x100
+
+/* x2APIC registers are accessed as MSRs at 0x800 + (offset >> 4) */
+#define AMD64_MSR_X2APIC_EOI       0x80B
+#define AMD64_MSR_X2APIC_SVR       0x80F
+#define AMD64_MSR_X2APIC_LVT_TIMER 0x832
+#define AMD64_MSR_X2APIC_TIMER_ICR 0x838
+#define AMD64_MSR_X2APIC_TIMER_DCR 0x83E
+
+#define AMD64_APIC_SVR_ENABLE    0x100
+#define AMD64_APIC_TIMER_VECTOR  32
+#define AMD64_APIC_TIMER_DIV16   0x3
+
 typedef unsigned int __u32;
 
 struct local_apic {
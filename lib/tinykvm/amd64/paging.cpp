@@ -624,6 +624,29 @@ std::vector<std::pair<uint64_t, uint64_t>> get_accessed_pages(const vMemory& mem
 	}, false);
 	return accessed_pages;
 }
+std::vector<std::pair<uint64_t, uint64_t>> get_dirty_pages(const vMemory& memory)
+{
+	std::vector<std::pair<uint64_t, uint64_t>> dirty_pages;
+	foreach_page(memory,
+	[&dirty_pages] (uint64_t, uint64_t& entry, size_t size) {
+		if ((entry & (PDE64_DIRTY | PDE64_PRESENT)) == (PDE64_DIRTY | PDE64_PRESENT) &&
+				((entry & PDE64_PS) || (size == PAGE_SIZE))) {
+			dirty_pages.push_back({(entry & PDE64_ADDR_MASK) & ~(size - 1), size});
+		}
+	});
+	return dirty_pages;
+}
+std::vector<uint64_t> get_cow_user_pages(vMemory& memory, const std::vector<std::pair<uint64_t, uint64_t>>& pages)
+{
+	std::vector<uint64_t> cow_pages;
+	for (const auto& [addr, size] : pages) {
+		page_at(memory, addr, [&] (uint64_t, uint64_t& entry, size_t) {
+			if ((entry & (PDE64_CLONEABLE | PDE64_USER)) == (PDE64_CLONEABLE | PDE64_USER))
+				cow_pages.push_back(addr & ~PageMask());
+		}, true);
+	}
+	return cow_pages;
+}
 
 void page_at(vMemory& memory, uint64_t addr, foreach_page_t callback, bool ignore_missing)
 {
@@ -695,13 +718,9 @@ static void clone_and_update_entry(vMemory& memory, uint64_t& entry, uint64_t*&
 	data = page.pmem;
 }
 static void zero_and_update_entry(vMemory& memory, uint64_t& entry, uint64_t*& data, uint64_t flags) {
-	/* Allocate new page, pass old vaddr to memory banks */
-	auto page = memory.new_page();
+	/* Allocate new zeroed page, preferably from the reservoir */
+	auto page = memory.new_zeroed_page();
 	assert((page.addr & 0x8000000000000FFF) == 0x0);
-	/* Zero all entries from old page, if it's dirty */
-	if (page.dirty) {
-		tinykvm::page_memzero(page.pmem);
-	}
 	/* Set new entry, copy flags and set as cloned */
 	entry = page.addr | (entry & PDE64_CLONED_MASK) | flags;
 	data = page.pmem;
@@ -715,7 +734,7 @@ static void unsafe_update_entry(vMemory& memory, uint64_t& entry, uint64_t*& dat
 	data = page.pmem;
 }
 
-WritablePage writable_page_at(vMemory& memory, uint64_t addr, uint64_t verify_flags, WritablePageOptions options)
+static WritablePage writable_page_walk(vMemory& memory, uint64_t addr, uint64_t verify_flags, WritablePageOptions options)
 {
 	CLPRINT("Creating a writable page for 0x%lX\n", addr);
 	auto* pml4 = memory.page_at(memory.page_tables);
@@ -769,7 +788,8 @@ WritablePage writable_page_at(vMemory& memory, uint64_t addr, uint64_t verify_fl
 							memory.increment_unlocked_pages(512);
 						}
 						goto entry_is_no_longer_copy_on_write;
-					} else if (memory.split_hugepages && (pd[k] & PDE64_PS)) { // 2MB page
+					} else if (memory.split_hugepages && (pd[k] & PDE64_PS)
+						&& !(memory.cow_dirty_hugepages && (pd[k] & PDE64_DIRTY))) { // 2MB page
 						CLPRINT("-> Splitting a 2MB page, addr=0x%lX rw=%lu cloneable=%lu\n",
 							addr, pd[k] & PDE64_RW, pd[k] & PDE64_CLONEABLE);
 						/* Remove PS flag */
@@ -826,7 +846,7 @@ WritablePage writable_page_at(vMemory& memory, uint64_t addr, uint64_t verify_fl
 						/* Return 4k page offset to new duplicated page. */
 						const uint64_t e = index_from_pt_entry(addr);
 						if (pd[k] & PDE64_USER)
-							memory.record_cow_leaf_user_page(addr);
+							memory.record_cow_leaf_user_page(addr, page.addr, PDE64_PT_SIZE);
 						return WritablePage {
 							.page = (char *)page.pmem + e * PAGE_SIZE,
 							.entry = pd[k],
@@ -883,7 +903,7 @@ entry_is_no_longer_copy_on_write:
 							pt[e] |= PDE64_RW | PDE64_PRESENT;
 						}
 						if (pt[e] & PDE64_USER)
-							memory.record_cow_leaf_user_page(addr);
+							memory.record_cow_leaf_user_page(addr, pt[e] & PDE64_ADDR_MASK, PAGE_SIZE);
 						CLPRINT("-> Cloning a PT entry: 0x%lX\n", pt[e]);
 					}
 					if ((pt[e] & verify_flags) == verify_flags) {
@@ -906,7 +926,90 @@ entry_is_no_longer_copy_on_write:
 	memory_exception("page_at: pml4 entry not present", addr, PDE64_PDPT_SIZE);
 }
 
-char * readable_page_at(const vMemory& memory, uint64_t addr, uint64_t flags)
+size_t writable_pages_ahead(vMemory& memory, uint64_t addr, size_t pages)
+{
+	/* The leaf page table must already be writable (cloned). */
+	auto* pml4 = memory.page_at(memory.page_tables);
+	const uint64_t i = (addr >> 39) & 511;
+	if ((pml4[i] & PDE64_PRESENT) == 0 || is_copy_on_write(pml4[i]))
+		return 0;
+	auto* pdpt = memory.page_at(pml4[i] & PDE64_ADDR_MASK);
+	const uint64_t j = index_from_pdpt_entry(addr);
+	if ((pdpt[j] & PDE64_PRESENT) == 0 || is_copy_on_write(pdpt[j]) || (pdpt[j] & PDE64_PS))
+		return 0;
+	auto* pd = memory.page_at(pdpt[j] & PDE64_ADDR_MASK);
+	const uint64_t k = index_from_pd_entry(addr);
+	if ((pd[k] & PDE64_PRESENT) == 0 || is_copy_on_write(pd[k]) || (pd[k] & PDE64_PS))
+		return 0;
+	auto* pt = memory.page_at(pd[k] & PDE64_ADDR_MASK);
+
+	/* Duplicate the following present, dirty CoW user pages,
+	   stopping at the first page that doesn't qualify. */
+	static constexpr uint64_t flags =
+		PDE64_CLONEABLE | PDE64_DIRTY | PDE64_USER | PDE64_PRESENT;
+	const uint64_t pt_base = addr & ~(PDE64_PT_SIZE - 1);
+	size_t count = 0;
+	try {
+		for (uint64_t e = index_from_pt_entry(addr) + 1; e < 512 && count < pages; e++) {
+			if ((pt[e] & (flags | PDE64_RW)) != flags)
+				break;
+			auto* data = memory.page_at(pt[e] & PDE64_ADDR_MASK);
+			clone_and_update_entry(memory, pt[e], data, PDE64_RW | PDE64_PRESENT);
+			memory.record_cow_leaf_user_page(pt_base + (e << 12), pt[e] & PDE64_ADDR_MASK, PAGE_SIZE);
+			count++;
+		}
+	} catch (const MemoryException&) {
+		/* Out of working memory: Leave the rest to page faults. */
+	}
+	return count;
+}
+
+static inline bool tlb_entry_unchanged(const GuestTLB::Entry& e) {
+	/* The CPU may set the accessed and dirty bits at any time */
+	return ((*e.entry ^ e.value) & ~(uint64_t)(PDE64_ACCESSED | PDE64_DIRTY)) == 0;
+}
+
+WritablePage writable_page_at(vMemory& memory, uint64_t addr, uint64_t verify_flags, WritablePageOptions options)
+{
+	/* Cached translations of pages that are already writable. Other
+	   vCPUs may change the page tables concurrently with SMP. */
+	const bool use_tlb = options.cached && LIKELY(!memory.smp_guards_enabled);
+	auto* cached = use_tlb ? memory.tlb.find(addr & ~PageMask()) : nullptr;
+	if (cached != nullptr && cached->writable && tlb_entry_unchanged(*cached)
+		&& !is_copy_on_write(cached->value) && (cached->value & verify_flags) == verify_flags)
+	{
+		if (UNLIKELY(memory.dirty_ring_entries != 0)) {
+			memory.record_dirty_ring_page((cached->value & PDE64_ADDR_MASK)
+				+ (addr & (cached->size - 1) & ~PageMask()));
+		}
+		return WritablePage {
+			.page = cached->page,
+			.entry = *cached->entry,
+			.size = cached->size,
+		};
+	}
+
+	WritablePage result = writable_page_walk(memory, addr, verify_flags, options);
+	if (use_tlb) {
+		auto& e = memory.tlb.slot(addr & ~PageMask());
+		e.vaddr = addr & ~PageMask();
+		e.entry = &result.entry;
+		e.value = result.entry;
+		e.flags = 0; /* Not verified on every level */
+		e.writable = true;
+		e.page  = result.page;
+		e.size  = result.size;
+		e.generation = memory.tlb.current();
+	}
+	if (UNLIKELY(memory.dirty_ring_entries != 0)) {
+		/* Host writes are invisible to the KVM dirty ring. */
+		memory.record_dirty_ring_page((result.entry & PDE64_ADDR_MASK)
+			+ (addr & (result.size - 1) & ~PageMask()));
+	}
+	return result;
+}
+
+static char * readable_page_walk(const vMemory& memory, uint64_t addr, uint64_t flags, uint64_t*& leaf, uint64_t& size)
 {
 	CLPRINT("Resolving a readable page for 0x%lX\n", addr);
 	auto* pml4 = memory.page_at(memory.page_tables);
@@ -929,6 +1032,8 @@ char * readable_page_at(const vMemory& memory, uint64_t addr, uint64_t flags)
 					/* Return the 4k segment inside the 2MB page */
 					auto* data = (char *)pt + e * PAGE_SIZE;
 					CLPRINT("-> Returning 2MB data: %p\n", data);
+					leaf = &pd[k];
+					size = PDE64_PT_SIZE;
 					return data;
 				}
 
@@ -936,6 +1041,8 @@ char * readable_page_at(const vMemory& memory, uint64_t addr, uint64_t flags)
 					const auto [pte_base, pte_mem, pte_size] = pte_from_index(e, pt_base, pt);
 					auto* data = memory.page_at(pte_mem);
 					CLPRINT("-> Returning 4k data: %p\n", data);
+					leaf = &pt[e];
+					size = PAGE_SIZE;
 					return (char *)data;
 				} // pt
 				memory_exception("readable_page_at: pt entry not readable", addr, PDE64_PTE_SIZE);
@@ -947,6 +1054,31 @@ char * readable_page_at(const vMemory& memory, uint64_t addr, uint64_t flags)
 	memory_exception("readable_page_at: pml4 entry not readable", addr, PDE64_PDPT_SIZE);
 }
 
+char * readable_page_at(const vMemory& memory, uint64_t addr, uint64_t flags, bool use_tlb)
+{
+	use_tlb = use_tlb && LIKELY(!memory.smp_guards_enabled);
+	auto* cached = use_tlb ? memory.tlb.find(addr & ~PageMask()) : nullptr;
+	if (cached != nullptr && (cached->flags & flags) == flags && tlb_entry_unchanged(*cached)) {
+		return cached->page;
+	}
+
+	uint64_t* leaf = nullptr;
+	uint64_t size = 0;
+	char* data = readable_page_walk(memory, addr, flags, leaf, size);
+	if (use_tlb) {
+		auto& e = memory.tlb.slot(addr & ~PageMask());
+		e.vaddr = addr & ~PageMask();
+		e.entry = leaf;
+		e.value = *leaf;
+		e.flags = flags;
+		e.writable = false;
+		e.page  = data;
+		e.size  = size;
+		e.generation = memory.tlb.current();
+	}
+	return data;
+}
+
 void memory_exception(const char* msg, uint64_t addr, uint64_t sz)
 {
 	throw MemoryException(msg, addr, sz);
@@ -1057,4 +1189,70 @@ size_t paging_merge_leaf_pages_into_hugepages(vMemory& memory, bool merge_if_dir
 	return merged_pages;
 } // paging_merge_leaf_pages_into_hugepages()
 
+size_t paging_merge_private_pages_into_hugepages(vMemory& memory)
+{
+	size_t merged_regions = 0;
+	// Every level must already belong to this fork
+	static constexpr uint64_t PRIVATE_MASK = PDE64_PRESENT | PDE64_CLONEABLE;
+	static constexpr uint64_t MERGE_MASK =
+		PDE64_PRESENT | PDE64_RW | PDE64_USER | PDE64_NX | PDE64_CLONEABLE;
+	static constexpr uint64_t MERGE_FLAGS = PDE64_PRESENT | PDE64_RW | PDE64_USER;
+	try {
+	auto* pml4 = memory.page_at(memory.page_tables);
+	for (size_t i = 0; i < 4; i++) { // 512GB entries
+		if ((pml4[i] & PRIVATE_MASK) != PDE64_PRESENT)
+			continue;
+		const auto [pdpt_base, pdpt_mem, pdpt_size] = pdpt_from_index(i, pml4);
+		auto* pdpt = memory.page_at(pdpt_mem);
+		for (uint64_t j = 0; j < 512; j++) { // 1GB entries
+			if ((pdpt[j] & PRIVATE_MASK) != PDE64_PRESENT || (pdpt[j] & PDE64_PS))
+				continue;
+			const auto [pd_base, pd_mem, pd_size] = pd_from_index(j, pdpt_base, pdpt);
+			auto* pd = memory.page_at(pd_mem);
+			for (uint64_t k = 0; k < 512; k++) { // 2MB entries
+				if ((pd[k] & PRIVATE_MASK) != PDE64_PRESENT || (pd[k] & PDE64_PS))
+					continue;
+				const auto [pt_base, pt_mem, pt_size] = pt_from_index(k, pd_base, pd);
+				auto* pt = memory.page_at(pt_mem);
+				// All 512 leaf pages must be privatized user pages with
+				// the same permissions, recorded as CoW pages in a bank.
+				const uint64_t first_entry = pt[0] & MERGE_MASK;
+				if ((first_entry & (MERGE_FLAGS | PDE64_CLONEABLE)) != MERGE_FLAGS)
+					continue;
+				bool can_merge = true;
+				MemoryBank* bank = nullptr;
+				for (size_t e = 0; e < 512 && can_merge; e++) {
+					const uint64_t paddr = pt[e] & PDE64_ADDR_MASK;
+					if ((pt[e] & MERGE_MASK) != first_entry) {
+						can_merge = false;
+						break;
+					}
+					if (bank == nullptr || !bank->within(paddr, PAGE_SIZE))
+						bank = memory.banks.bank_at(paddr);
+					const size_t page = (bank != nullptr) ? (paddr - bank->addr) / PAGE_SIZE : 0;
+					can_merge = bank != nullptr && bank->has_cow_page(page)
+						&& bank->cow_vaddr[page] == pt_base + (e << 12);
+				}
+				if (!can_merge)
+					continue;
+				// Move the region into a single 2MB page
+				auto hugepage = memory.new_hugepage();
+				for (size_t e = 0; e < 512; e++) {
+					const uint64_t paddr = pt[e] & PDE64_ADDR_MASK;
+					tinykvm::page_duplicate(hugepage.pmem + e * 512, memory.page_at(paddr));
+					bank = memory.banks.bank_at(paddr);
+					bank->forget_cow_page((paddr - bank->addr) / PAGE_SIZE);
+				}
+				pd[k] = hugepage.addr | first_entry | PDE64_PS | PDE64_ACCESSED | PDE64_DIRTY;
+				memory.record_cow_leaf_user_page(pt_base, hugepage.addr, PDE64_PT_SIZE);
+				merged_regions++;
+			} // pd[k]
+		} // pdpt[j]
+	} // pml4[i]
+	} catch (const MemoryException&) {
+		// Out of working memory, merge again after the next full reset
+	}
+	return merged_regions;
+} // paging_merge_private_pages_into_hugepages()
+
 } // tinykvm
@@ -16,6 +16,10 @@ extern void foreach_page(vMemory&, foreach_page_t callback, bool skip_oob_addres
 extern void foreach_page(const vMemory&, foreach_page_t callback, bool skip_oob_addresses = true);
 extern void foreach_page_makecow(vMemory&, uint64_t kernel_end, uint64_t shared_memory_boundary, bool split_accessed_hugepages = false);
 extern std::vector<std::pair<uint64_t, uint64_t>> get_accessed_pages(const vMemory& memory);
+// Returns the physical address and size of every dirty leaf page
+extern std::vector<std::pair<uint64_t, uint64_t>> get_dirty_pages(const vMemory& memory);
+// Returns the (4k-aligned) addresses of the given pages that are copy-on-write user pages
+extern std::vector<uint64_t> get_cow_user_pages(vMemory&, const std::vector<std::pair<uint64_t, uint64_t>>& pages);
 
 extern void page_at(vMemory&, uint64_t addr, foreach_page_t, bool ignore_missing = false);
 struct WritablePage {
@@ -29,11 +33,18 @@ struct WritablePage {
 struct WritablePageOptions {
 	bool zeroes = false;
 	bool allow_dirty = false;
+	bool cached = true; /* Use the translation cache of the memory */
 };
 extern WritablePage writable_page_at(vMemory&, uint64_t addr, uint64_t flags, WritablePageOptions = {});
-extern char * readable_page_at(const vMemory&, uint64_t addr, uint64_t flags);
+// Duplicates up to N dirty copy-on-write pages following addr in the same page table.
+// Returns the number of pages duplicated.
+extern size_t writable_pages_ahead(vMemory&, uint64_t addr, size_t pages);
+extern char * readable_page_at(const vMemory&, uint64_t addr, uint64_t flags, bool cached = true);
 // Merges leaf pages back into hugepages where possible. Returns number of merged pages.
 extern size_t paging_merge_leaf_pages_into_hugepages(vMemory&, bool merge_if_dirty = false);
+// Coalesces 2MB regions where every leaf page has been privatized by a fork
+// into single 2MB working memory pages. Returns number of merged regions.
+extern size_t paging_merge_private_pages_into_hugepages(vMemory&);
 
 static inline bool page_is_zeroed(const uint64_t* page) {
 	for (size_t i = 0; i < 512; i += 8) {
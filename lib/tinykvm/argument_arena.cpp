@@ -0,0 +1,99 @@
+#include "machine.hpp"
+
+#include <cstring>
+#include <mutex>
+#include "amd64/paging.hpp"
+static constexpr bool VERBOSE_ARGUMENT_ARENA = false;
+
+namespace tinykvm {
+static constexpr uint64_t ARENA_ALIGN = 1ULL << 21; /* Whole 2MB leaf pages */
+
+/* Shared by a master and all its forks. The arena is at the top of
+   main memory, which forks share with the master, so the host writes
+   arguments directly into memory that every VM sees at once. */
+struct ArgumentArena
+{
+	uint64_t begin;
+	size_t   slot_size;
+	std::mutex mtx;
+	std::vector<uint32_t> free_slots;
+};
+
+void Machine::prepare_argument_arena(size_t bytes_per_slot, unsigned slots)
+{
+	if (m_prepped || m_forked) {
+		throw MachineException("Argument arena must be prepared before prepare_copy_on_write()");
+	}
+	if (m_arena != nullptr || bytes_per_slot == 0 || slots == 0) {
+		throw MachineException("Argument arena already prepared or empty");
+	}
+	bytes_per_slot = (bytes_per_slot + PageMask()) & ~PageMask();
+	const uint64_t total = (bytes_per_slot * slots + ARENA_ALIGN - 1) & ~(ARENA_ALIGN - 1);
+	const uint64_t begin = (max_address() - total) & ~(ARENA_ALIGN - 1);
+	if (total >= memory.size || begin < this->mmap_current()) {
+		throw MachineException("Not enough memory for argument arena", total);
+	}
+
+	auto arena = std::make_shared<ArgumentArena>();
+	arena->begin = begin;
+	arena->slot_size = bytes_per_slot;
+	/* Lowest slots are handed out first */
+	for (unsigned i = slots; i > 0; i--)
+		arena->free_slots.push_back(i - 1);
+	this->m_arena = std::move(arena);
+	this->m_arena_begin = begin;
+
+	if constexpr (VERBOSE_ARGUMENT_ARENA) {
+		printf("Argument arena: 0x%lX -> 0x%lX, %u slots of %zu bytes\n",
+			begin, begin + total, slots, bytes_per_slot);
+	}
+}
+
+std::pair<Machine::address_t, char*> Machine::arena_allocate(size_t bytes)
+{
+	if (m_arena == nullptr)
+		return {0, nullptr};
+	if (m_arena_slot < 0)
+	{
+		std::lock_guard<std::mutex> lock(m_arena->mtx);
+		if (m_arena->free_slots.empty())
+			return {0, nullptr};
+		this->m_arena_slot = m_arena->free_slots.back();
+		m_arena->free_slots.pop_back();
+	}
+	/* Allocations passed to the previous vmcall are no longer needed */
+	if (m_arena_recycle) {
+		this->m_arena_recycle = false;
+		this->m_arena_used = 0;
+	}
+	const size_t aligned = (bytes + 0x7) & ~(size_t) 0x7;
+	if (aligned > m_arena->slot_size - m_arena_used)
+		return {0, nullptr};
+
+	const address_t addr = m_arena->begin + m_arena_slot * m_arena->slot_size + m_arena_used;
+	this->m_arena_used += aligned;
+	return {addr, memory.at(addr, bytes)};
+}
+
+uint64_t Machine::arena_push(__u64& sp, const void* data, size_t length)
+{
+	auto [addr, dst] = this->arena_allocate(length);
+	if (dst == nullptr)
+		return stack_push(sp, data, length);
+	std::memcpy(dst, data, length);
+	return addr;
+}
+
+void Machine::release_arena_slot()
+{
+	if (m_arena_slot >= 0)
+	{
+		std::lock_guard<std::mutex> lock(m_arena->mtx);
+		m_arena->free_slots.push_back(m_arena_slot);
+	}
+	this->m_arena_slot = -1;
+	this->m_arena_used = 0;
+	this->m_arena_recycle = false;
+}
+
+} // tinykvm
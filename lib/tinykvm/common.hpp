@@ -48,10 +48,18 @@ namespace tinykvm
 		// when user_defined is non-empty, it will use that label
 		// instead of "UserDefined"
 		void print(const char* user_defined = "") const;
+		// Zero-fill page faults served from the pre-zeroed page reservoir
+		uint64_t zeroed_page_hits = 0;
+		uint64_t zeroed_page_misses = 0;
+		// 2MB regions merged into hugepages by long-lived forks
+		uint64_t hugepage_regions_merged = 0;
 		// Clear all profiling samples
 		void reset() {
 			for (auto& vec : times)
 				vec.clear();
+			zeroed_page_hits = 0;
+			zeroed_page_misses = 0;
+			hugepage_regions_merged = 0;
 		}
 		void clear() { reset(); } // Alias
 	};
@@ -65,6 +73,12 @@ namespace tinykvm
 		uint64_t heap_address_hint = 0;
 		uint64_t vmem_base_address = 0;
 		std::string_view binary = {};
+		/* When set to a file descriptor of the ELF binary being loaded,
+		   the whole pages of loadable segments are mapped privately from
+		   the file instead of being copied into guest memory. Pages are
+		   then read on first access and copied on first write. Ignored
+		   when main memory uses hugepages or a snapshot file. */
+		int binary_fd = -1;
 		std::vector<VirtualRemapping> remappings {};
 
 		bool verbose_loader = false;
@@ -96,6 +110,47 @@ namespace tinykvm
 		   from the master VM to the forked VM instead of
 		   resetting the memory banks. */
 		bool reset_keep_all_work_memory = false;
+		/* When non-zero, forks using reset_keep_all_work_memory will
+		   enable the KVM dirty ring with this many entries (power of two),
+		   and reset_to() will only restore the pages dirtied since the
+		   last reset. Ignored when KVM has no dirty ring support. */
+		uint32_t reset_dirty_ring_entries = 0;
+		/* When non-zero, forks using reset_keep_all_work_memory will,
+		   every this many resets, merge each 2MB region where all 512
+		   leaf pages have been privatized into a single 2MB working
+		   memory page, recovering guest TLB reach after warmup. The
+		   replaced 4k pages are released on the next full reset. */
+		uint32_t reset_merge_hugepages_interval = 0;
+		/* When enabled, memory banks are borrowed from a process-wide
+		   pool shared by all VMs, and on full resets every bank beyond
+		   reset_free_work_mem (at least one bank is kept) is given back
+		   to the pool. max_cow_mem is still enforced per VM. */
+		bool memory_bank_pool = false;
+		/* The number of working memory pages forks keep zeroed ahead
+		   of time. The pages are set aside on fork and reset_to(), and
+		   zeroed on a background thread. Copy-on-write faults on pages
+		   that need zeroing will take the pages that are ready. */
+		uint32_t zeroed_page_reservoir = 0;
+		/* When non-zero, forks take their KVM VM and vCPU, with the
+		   kvm_run mapping and timeout timer, from a per-thread pool and
+		   give them back on destruction, keeping up to this many per
+		   thread. Forks that have used SMP are not given back. */
+		uint32_t vcpu_pool_size = 0;
+		/* When enabled, execution timeouts are enforced by a process-wide
+		   watchdog thread instead of a POSIX timer per vCPU. Arming and
+		   disarming a timeout no longer needs system calls, but timeouts
+		   have millisecond granularity. */
+		bool watchdog_timeouts = false;
+		/* When enabled, execution timeouts are programmed into an
+		   in-kernel local APIC timer on each vCPU. The timer interrupt
+		   exits the guest through the interrupt handlers, so no host
+		   timers or signals are involved. Guests can disable interrupts,
+		   so the execution watchdog is still armed as a backstop. */
+#ifdef TINYKVM_FAST_EXECUTION_TIMEOUT
+		bool lapic_timeouts = true;
+#else
+		bool lapic_timeouts = false;
+#endif
 		/* Force-relocate fixed addresses with mmap(). */
 		bool relocate_fixed_mmap = true;
 		/* Make heap executable, to support JIT. */
@@ -117,10 +172,28 @@ namespace tinykvm
 		   should be created if missing, opened, or created
 		   and possibly overwritten. */
 		SnapshotMode snapshot_mode = OpenOrCreate;
+		/* Delta snapshots, made with Machine::save_snapshot_delta(),
+		   that are privately mapped on top of an existing snapshot_file
+		   in the given order. The VM state is loaded from the last one. */
+		std::vector<std::string> snapshot_deltas {};
+		/* When loading a snapshot, populate the accessed ranges that
+		   were saved with it on a background thread, in the order they
+		   were saved. When disabled, they are only advised (WILLNEED). */
+		bool snapshot_prefetch = true;
 		/* When using hugepages, cover the given size with
 		   hugepages, unless 0, in which case the entire
 		   main memory will be covered. */
 		size_t hugepages_arena_size = 0UL;
+		/* When enabled, working memory banks are backed by hugepages
+		   (MAP_HUGETLB), falling back to regular pages when the system
+		   has no hugepages available. Forks that duplicate whole 2MB
+		   pages will then also be backed by 2MB pages on the host. */
+		bool hugepage_working_memory = false;
+		/* When enabled together with split_hugepages, 2MB pages that
+		   were written to in the master VM are duplicated as whole 2MB
+		   pages on write instead of being split into 4k pages. Suits
+		   guests that write most of a 2MB region anyway (JIT, arenas). */
+		bool cow_dirty_hugepages = false;
 	};
 
 	class MachineException : public std::exception {
@@ -169,6 +242,18 @@ namespace tinykvm
 	template<class T>
 	struct is_stdstring : public std::is_same<T, std::basic_string<char>> {};
 
+	/* A vmcall argument that is copied into the guest, and passed as a
+	   pointer and a length, taking two argument registers:
+	     vm.vmcall("func", tinykvm::ArgumentBuffer{payload});
+	   calls func(const char* data, size_t len). */
+	struct ArgumentBuffer {
+		const void* data;
+		size_t size;
+
+		ArgumentBuffer(const void* d, size_t s) : data(d), size(s) {}
+		explicit ArgumentBuffer(std::string_view sv) : data(sv.data()), size(sv.size()) {}
+	};
+
 	struct PerVCPUTable {
 		int cpuid;
 		int userval1;
@@ -0,0 +1,415 @@
+#include "machine.hpp"
+
+#include <atomic>
+#include <cstring>
+#include <memory>
+#include <fcntl.h>
+#include <linux/userfaultfd.h>
+#include <poll.h>
+#include <stdexcept>
+#include <sys/eventfd.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <thread>
+#include <unistd.h>
+#ifdef TINYKVM_SNAPSHOT_ZSTD
+#include <zstd.h>
+#endif
+#ifdef TINYKVM_SNAPSHOT_ZLIB
+#include <zlib.h>
+#endif
+#include "amd64/paging.hpp"
+static constexpr bool VERBOSE_SNAPSHOT_PAGER = false;
+
+namespace tinykvm {
+static constexpr size_t PSIZE = vMemory::PageSize();
+
+/* Compressed snapshot file layout:
+   [header] [page data ...] [page index]
+   The index has one entry for every page of main memory followed by
+   the cold start state area. Zero pages have no data, and pages that
+   do not compress are stored as they are. */
+enum SnapshotCodec : uint32_t {
+	CODEC_NONE = 0, /* Only zero pages are left out */
+	CODEC_ZLIB = 1,
+	CODEC_ZSTD = 2,
+};
+struct CompressedSnapshotHeader {
+	static constexpr uint32_t MAGIC = 0x564D435A; // 'VMCZ'
+	uint32_t magic;
+	uint32_t page_size;
+	uint32_t codec;
+	uint32_t reserved;
+	uint64_t memory_size;
+	uint64_t pages;
+	uint64_t index_offset;
+};
+struct CompressedPage {
+	uint64_t offset : 48;
+	uint64_t size   : 16; /* 0: Zero page, PSIZE: Uncompressed */
+};
+static_assert(sizeof(CompressedPage) == 8);
+
+static bool codec_supported(uint32_t codec)
+{
+	switch (codec) {
+	case CODEC_NONE:
+		return true;
+#ifdef TINYKVM_SNAPSHOT_ZLIB
+	case CODEC_ZLIB:
+		return true;
+#endif
+#ifdef TINYKVM_SNAPSHOT_ZSTD
+	case CODEC_ZSTD:
+		return true;
+#endif
+	default:
+		return false;
+	}
+}
+
+/* Compresses pages with the best codec this build has */
+struct PageCompressor {
+#if defined(TINYKVM_SNAPSHOT_ZSTD)
+	static constexpr uint32_t codec = CODEC_ZSTD;
+	PageCompressor() : cctx(ZSTD_createCCtx()) {
+		if (cctx == nullptr)
+			throw std::runtime_error("Failed to create zstd compression context");
+	}
+	~PageCompressor() { ZSTD_freeCCtx(cctx); }
+	ZSTD_CCtx* cctx;
+#elif defined(TINYKVM_SNAPSHOT_ZLIB)
+	static constexpr uint32_t codec = CODEC_ZLIB;
+#else
+	static constexpr uint32_t codec = CODEC_NONE;
+#endif
+	/* Returns the compressed size, or 0 when the page stays as it is */
+	size_t compress(const char* src, char* dst, size_t dstlen)
+	{
+#if defined(TINYKVM_SNAPSHOT_ZSTD)
+		const size_t clen = ZSTD_compressCCtx(cctx, dst, dstlen, src, PSIZE, 1);
+		if (!ZSTD_isError(clen) && clen < PSIZE)
+			return clen;
+#elif defined(TINYKVM_SNAPSHOT_ZLIB)
+		uLongf clen = dstlen;
+		if (compress2((Bytef*)dst, &clen, (const Bytef*)src, PSIZE, 1) == Z_OK && clen < PSIZE)
+			return clen;
+#else
+		(void)src; (void)dst; (void)dstlen;
+#endif
+		return 0;
+	}
+};
+
+static bool decompress_page(uint32_t codec, const char* src, size_t len, char* dst)
+{
+	switch (codec) {
+#ifdef TINYKVM_SNAPSHOT_ZLIB
+	case CODEC_ZLIB: {
+		uLongf dlen = PSIZE;
+		return uncompress((Bytef*)dst, &dlen, (const Bytef*)src, len) == Z_OK && dlen == PSIZE;
+	}
+#endif
+#ifdef TINYKVM_SNAPSHOT_ZSTD
+	case CODEC_ZSTD: {
+		/* The pager thread and loading threads keep their own context */
+		thread_local std::unique_ptr<ZSTD_DCtx, size_t(*)(ZSTD_DCtx*)>
+			dctx { ZSTD_createDCtx(), ZSTD_freeDCtx };
+		const size_t dlen = ZSTD_decompressDCtx(dctx.get(), dst, PSIZE, src, len);
+		return !ZSTD_isError(dlen) && dlen == PSIZE;
+	}
+#endif
+	default:
+		(void)src; (void)len; (void)dst;
+		return false;
+	}
+}
+
+static void read_compressed_page(int fd, uint32_t codec, const CompressedPage& entry, char* dst, char* scratch)
+{
+	if (entry.size == 0) {
+		std::memset(dst, 0, PSIZE);
+		return;
+	}
+	char* src = (entry.size == PSIZE) ? dst : scratch;
+	if (pread(fd, src, entry.size, entry.offset) != ssize_t(entry.size)) {
+		throw MachineException("Failed to read compressed snapshot page", entry.offset);
+	}
+	if (entry.size == PSIZE)
+		return;
+	if (!decompress_page(codec, src, entry.size, dst)) {
+		throw MachineException("Corrupt compressed snapshot page", entry.offset);
+	}
+}
+
+void Machine::save_compressed_snapshot(const std::string& filename,
+	const std::vector<std::pair<uint64_t, uint64_t>>& populate_pages) const
+{
+	if (this->is_forked()) {
+		throw MachineException("Cannot save snapshot state of a forked VM");
+	}
+	if (this->banked_memory_pages() != 0) {
+		throw MachineException("Compressed snapshot VM must have all its state in main memory");
+	}
+	const size_t state_size = vMemory::ColdStartStateSize();
+	/* Keep the user area of the state, which follows the state */
+	std::vector<char> state(state_size);
+	if (memory.has_snapshot_area()) {
+		std::memcpy(state.data(), memory.get_snapshot_state_area(), state_size);
+	}
+	this->save_snapshot_state_to(state.data(), populate_pages);
+
+	const int fd = open(filename.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+	if (fd < 0) {
+		throw std::runtime_error("Failed to create compressed VM snapshot: " + filename);
+	}
+	try {
+		PageCompressor compressor;
+		CompressedSnapshotHeader header {
+			.magic = 0, /* Written last */
+			.page_size = PSIZE,
+			.codec = PageCompressor::codec,
+			.reserved = 0,
+			.memory_size = memory.size,
+			.pages = (memory.size + state_size) / PSIZE,
+			.index_offset = 0,
+		};
+		std::vector<CompressedPage> index(header.pages);
+		std::vector<char> out;
+		out.reserve(1UL << 20);
+		uint64_t offset = sizeof(header);
+		auto flush = [&] {
+			if (!out.empty() && pwrite(fd, out.data(), out.size(), offset - out.size()) != ssize_t(out.size()))
+				throw std::runtime_error("Failed to write compressed VM snapshot: " + filename);
+			out.clear();
+		};
+		std::vector<char> scratch(PSIZE * 2);
+		for (uint64_t page = 0; page < header.pages; page++)
+		{
+			const char* src = (page * PSIZE < memory.size)
+				? &memory.ptr[page * PSIZE] : &state[page * PSIZE - memory.size];
+			if (page_is_zeroed((const uint64_t*)src))
+				continue;
+			const char* data = src;
+			size_t len = compressor.compress(src, scratch.data(), scratch.size());
+			if (len != 0)
+				data = scratch.data();
+			else
+				len = PSIZE;
+			index[page].offset = offset;
+			index[page].size = len;
+			out.insert(out.end(), data, data + len);
+			offset += len;
+			if (out.size() >= (1UL << 20))
+				flush();
+		}
+		flush();
+
+		header.index_offset = offset;
+		const size_t index_bytes = index.size() * sizeof(CompressedPage);
+		if (pwrite(fd, index.data(), index_bytes, offset) != ssize_t(index_bytes)) {
+			throw std::runtime_error("Failed to write compressed VM snapshot: " + filename);
+		}
+		header.magic = CompressedSnapshotHeader::MAGIC;
+		if (pwrite(fd, &header, sizeof(header), 0) != sizeof(header)) {
+			throw std::runtime_error("Failed to write compressed VM snapshot: " + filename);
+		}
+	} catch (...) {
+		close(fd);
+		throw;
+	}
+	close(fd);
+}
+
+/* Resolves missing-page faults in main memory, from both the
+   guest (through KVM) and the host, by decompressing the page. */
+struct SnapshotPager
+{
+	SnapshotPager(int f, int u, int s, char* p, uint32_t c, std::vector<CompressedPage> idx)
+		: fd(f), uffd(u), stop_fd(s), base(p), codec(c), index(std::move(idx)),
+		  thread(&SnapshotPager::run, this) {}
+	~SnapshotPager()
+	{
+		const uint64_t one = 1;
+		[[maybe_unused]] auto res = write(stop_fd, &one, sizeof(one));
+		thread.join();
+		close(stop_fd);
+		close(uffd);
+		close(fd);
+	}
+	void run();
+
+	const int fd;
+	const int uffd;
+	const int stop_fd;
+	char* const base;
+	const uint32_t codec;
+	const std::vector<CompressedPage> index;
+	/* A page that could not be read. It is given to the guest as a zero
+	   page so the faulting thread can continue, and the next vCPU exit
+	   fails the VM with an exception. */
+	std::atomic<int64_t> failed_page = -1;
+	std::thread thread;
+};
+
+void SnapshotPager::run()
+{
+	alignas(4096) char page[PSIZE];
+	std::vector<char> scratch(PSIZE);
+	struct pollfd fds[2] = {
+		{ .fd = uffd, .events = POLLIN, .revents = 0 },
+		{ .fd = stop_fd, .events = POLLIN, .revents = 0 },
+	};
+	while (true)
+	{
+		if (poll(fds, 2, -1) < 0) {
+			if (errno == EINTR)
+				continue;
+			break;
+		}
+		if (fds[1].revents != 0)
+			break;
+		struct uffd_msg msg;
+		if (read(uffd, &msg, sizeof(msg)) != sizeof(msg))
+			continue;
+		if (msg.event != UFFD_EVENT_PAGEFAULT)
+			continue;
+		const uint64_t addr = msg.arg.pagefault.address & ~PageMask();
+		const uint64_t pageno = (addr - uint64_t(base)) / PSIZE;
+		if (pageno >= index.size())
+			continue;
+		int res;
+		if (index[pageno].size == 0) {
+			struct uffdio_zeropage zero {
+				.range = { .start = addr, .len = PSIZE }, .mode = 0, .zeropage = 0
+			};
+			res = ioctl(uffd, UFFDIO_ZEROPAGE, &zero);
+		} else {
+			try {
+				read_compressed_page(fd, codec, index[pageno], page, scratch.data());
+			} catch (const std::exception&) {
+				/* A faulting thread cannot be left blocked */
+				this->failed_page = pageno * PSIZE;
+				std::memset(page, 0, PSIZE);
+			}
+			struct uffdio_copy copy {
+				.dst = addr, .src = uint64_t(page), .len = PSIZE, .mode = 0, .copy = 0
+			};
+			res = ioctl(uffd, UFFDIO_COPY, &copy);
+		}
+		/* EEXIST: Another fault on the same page was already resolved */
+		if (res < 0 && errno != EEXIST) {
+			this->failed_page = pageno * PSIZE;
+		}
+		if constexpr (VERBOSE_SNAPSHOT_PAGER) {
+			printf("Snapshot pager: Page 0x%lX (%u bytes)\n", pageno * PSIZE, unsigned(index[pageno].size));
+		}
+	}
+}
+
+static int create_userfaultfd()
+{
+	int uffd = syscall(SYS_userfaultfd, O_CLOEXEC | O_NONBLOCK);
+#ifdef USERFAULTFD_IOC_NEW
+	if (uffd < 0) {
+		/* Unprivileged processes may use the device instead */
+		const int dev = open("/dev/userfaultfd", O_RDWR | O_CLOEXEC);
+		if (dev >= 0) {
+			uffd = ioctl(dev, USERFAULTFD_IOC_NEW, O_CLOEXEC | O_NONBLOCK);
+			close(dev);
+		}
+	}
+#endif
+	if (uffd < 0)
+		return -1;
+	struct uffdio_api api { .api = UFFD_API, .features = 0, .ioctls = 0 };
+	if (ioctl(uffd, UFFDIO_API, &api) < 0) {
+		close(uffd);
+		return -1;
+	}
+	return uffd;
+}
+
+void vMemory::snapshot_pager_failed() const
+{
+	const int64_t page = pager->failed_page.load(std::memory_order_relaxed);
+	if (UNLIKELY(page >= 0)) {
+		throw MachineException("Failed to read a page from the compressed snapshot", page);
+	}
+}
+
+bool vMemory::is_compressed_snapshot(int fd)
+{
+	uint32_t magic = 0;
+	return pread(fd, &magic, sizeof(magic), 0) == sizeof(magic)
+		&& magic == CompressedSnapshotHeader::MAGIC;
+}
+
+vMemory::AllocationResult
+	vMemory::allocate_compressed_memory(const MachineOptions&, size_t size, int fd)
+{
+	const size_t state_size = ColdStartStateSize();
+	char* ptr = (char*)MAP_FAILED;
+	try {
+		CompressedSnapshotHeader header;
+		if (pread(fd, &header, sizeof(header), 0) != sizeof(header)
+			|| header.page_size != PSIZE || header.memory_size != size
+			|| header.pages != (size + state_size) / PSIZE) {
+			throw std::runtime_error("Compressed VM snapshot does not match the VM memory size");
+		}
+		if (!codec_supported(header.codec)) {
+			throw std::runtime_error("Compressed VM snapshot uses a codec that this build does not support ("
+				+ std::to_string(header.codec) + ")");
+		}
+		std::vector<CompressedPage> index(header.pages);
+		const size_t index_bytes = index.size() * sizeof(CompressedPage);
+		if (pread(fd, index.data(), index_bytes, header.index_offset) != ssize_t(index_bytes)) {
+			throw std::runtime_error("Failed to read compressed VM snapshot index");
+		}
+
+		ptr = (char*)mmap(NULL, size + state_size, PROT_READ | PROT_WRITE,
+			MAP_ANONYMOUS | MAP_PRIVATE | MAP_NORESERVE, -1, 0);
+		if (ptr == MAP_FAILED) {
+			memory_exception("Failed to allocate guest memory", 0, size + state_size);
+		}
+		/* The cold start state is needed right away */
+		std::vector<char> scratch(PSIZE);
+		for (size_t page = size / PSIZE; page < index.size(); page++) {
+			if (index[page].size != 0)
+				read_compressed_page(fd, header.codec, index[page], &ptr[page * PSIZE], scratch.data());
+		}
+
+		const int uffd = create_userfaultfd();
+		const int stop_fd = (uffd >= 0) ? eventfd(0, EFD_CLOEXEC) : -1;
+		struct uffdio_register reg {
+			.range = { .start = uint64_t(ptr), .len = size },
+			.mode = UFFDIO_REGISTER_MODE_MISSING, .ioctls = 0
+		};
+		if (stop_fd >= 0 && ioctl(uffd, UFFDIO_REGISTER, &reg) == 0) {
+			auto pager = std::make_shared<SnapshotPager>(fd, uffd, stop_fd, ptr, header.codec, std::move(index));
+			return AllocationResult{ptr, size, fd, std::move(pager)};
+		}
+		/* Without userfaultfd, decompress every page now */
+		if (stop_fd >= 0)
+			close(stop_fd);
+		if (uffd >= 0)
+			close(uffd);
+		if constexpr (VERBOSE_SNAPSHOT_PAGER) {
+			printf("Snapshot pager: userfaultfd unavailable, loading every page\n");
+		}
+		for (size_t page = 0; page < size / PSIZE; page++) {
+			if (index[page].size != 0)
+				read_compressed_page(fd, header.codec, index[page], &ptr[page * PSIZE], scratch.data());
+		}
+	} catch (...) {
+		if (ptr != MAP_FAILED)
+			munmap(ptr, size + state_size);
+		close(fd);
+		throw;
+	}
+	close(fd);
+	return AllocationResult{ptr, size, fd, nullptr};
+}
+
+} // tinykvm
@@ -3,6 +3,7 @@ struct kvm_run;
 struct kvm_regs;
 struct kvm_sregs;
 struct kvm_lapic_state;
+struct kvm_dirty_gfn;
 #include <linux/types.h>
 
 namespace tinykvm {
@@ -4,12 +4,14 @@
 #include "smp.hpp"
 #include "util/scoped_profiler.hpp"
 #include "util/threadpool.h"
+#include <algorithm>
 #include <cassert>
 #include <cstring>
 #include <fcntl.h>
 #include <linux/kvm.h>
 #include <sys/ioctl.h>
 extern "C" int close(int);
+extern "C" int gettid();
 //#define KVM_VERBOSE_MEMORY
 
 namespace tinykvm {
@@ -27,6 +29,28 @@ namespace tinykvm {
 	static int kvm_open();
 	constexpr uint64_t PageMask = vMemory::PageSize()-1;
 
+/* KVM VMs and vCPUs given back by destroyed forks, per thread, so that
+   the next fork on the same thread can skip creating them. Every memory
+   slot has been deleted, and the settings that must be decided before
+   the vCPU is created are kept alongside. */
+struct PooledVM {
+	int fd;
+	vCPU vcpu;
+	uint32_t dirty_ring_request;
+	uint32_t dirty_ring_entries;
+};
+struct PerThreadVMPool {
+	std::vector<PooledVM> vms;
+
+	~PerThreadVMPool() {
+		for (auto& vm : vms) {
+			vm.vcpu.deinit();
+			close(vm.fd);
+		}
+	}
+};
+static thread_local PerThreadVMPool vm_pool;
+
 __attribute__ ((cold))
 Machine::Machine(std::string_view binary, const MachineOptions& options)
 	: m_forked {false},
@@ -38,11 +62,12 @@ Machine::Machine(std::string_view binary, const MachineOptions& options)
 	  m_mt   {nullptr} /* Explicitly */
 {
 	assert(kvm_fd != -1 && "Call Machine::init() first");
-	if (options.mmap_backed_files && !options.snapshot_file.empty()) {
-		throw MachineException("Cannot have VM snapshot with mmap-backed files at the same time");
-	}
 
 	this->fd = create_kvm_vm();
+	/* The local APIC must be created before any vCPUs are. */
+	if (options.lapic_timeouts) {
+		enable_split_irqchip(this->fd);
+	}
 
 	install_memory(0, memory.vmem(), false);
 
@@ -54,6 +79,13 @@ Machine::Machine(std::string_view binary, const MachineOptions& options)
 			if (options.verbose_loader) {
 				printf("Loaded VM snapshot state\n");
 			}
+			/* The binary is already loaded, but needed for symbols */
+			if (!binary.empty()) {
+				this->assign_binary(binary);
+			}
+			this->m_snapshot_layers.push_back(options.snapshot_file);
+			this->m_snapshot_layers.insert(m_snapshot_layers.end(),
+				options.snapshot_deltas.begin(), options.snapshot_deltas.end());
 			return;
 		}
 		// If the file does not exist, or anything else failed, we continue
@@ -95,6 +127,7 @@ Machine::Machine(const Machine& other, const MachineOptions& options)
 	  m_just_reset {true},
 	  m_relocate_fixed_mmap {options.relocate_fixed_mmap},
 	  m_binary {options.binary.empty() ? other.m_binary : options.binary},
+	  m_symbols {options.binary.empty() ? other.m_symbols : nullptr},
 	  memory   {*this, options, other.memory},
 	  m_image_base    {other.m_image_base},
 	  m_stack_address {other.m_stack_address},
@@ -104,6 +137,8 @@ Machine::Machine(const Machine& other, const MachineOptions& options)
 	  m_start_address {other.m_start_address},
 	  m_kernel_end    {other.m_kernel_end},
 	  m_mmap_cache    {other.m_mmap_cache},
+	  m_arena  {other.m_arena},
+	  m_arena_begin {other.m_arena_begin},
 	  m_mt     {nullptr}
 {
 	assert(kvm_fd != -1 && "Call Machine::init() first");
@@ -111,9 +146,27 @@ Machine::Machine(const Machine& other, const MachineOptions& options)
 		throw MachineException("Source Machine is not prepared for forking");
 	}
 
+	if (options.reset_keep_all_work_memory) {
+		this->m_dirty_ring_request = options.reset_dirty_ring_entries;
+	}
+	this->m_vcpu_pool_size = options.vcpu_pool_size;
+
 	/* Unfortunately we have to create a new VM because
-	   memory is tied to VMs and not vCPUs. */
-	this->fd = create_kvm_vm();
+	   memory is tied to VMs and not vCPUs. It can be taken
+	   from a pool of VMs that forks have given back. */
+	if (m_vcpu_pool_size == 0 || !this->acquire_pooled_vm(options))
+	{
+		this->fd = create_kvm_vm();
+
+		/* The dirty ring must be enabled before any vCPUs are created. */
+		if (m_dirty_ring_request != 0) {
+			memory.dirty_ring_entries =
+				enable_dirty_ring(this->fd, m_dirty_ring_request);
+		}
+		if (options.lapic_timeouts) {
+			enable_split_irqchip(this->fd);
+		}
+	}
 
 	/* Reuse pre-CoWed pagetable from the master machine */
 	this->install_memory(0, memory.vmem(), false);
@@ -134,6 +187,8 @@ Machine::Machine(const Machine& other, const MachineOptions& options)
 	/* Initialize vCPU and long mode (fast path) */
 	this->vcpu.init(0, *this, options);
 	this->setup_cow_mode(&other);
+	this->prefault_warm_set(other);
+	this->memory.banks.refill_zeroed_pages();
 
 	/* We have to make a copy here, to make sure the fork knows
 	   about the multi-threading state. */
@@ -156,10 +211,67 @@ Machine::Machine(const Machine& other, const MachineOptions& options)
 __attribute__ ((cold))
 Machine::~Machine()
 {
+	if (m_background_reset.valid())
+		m_background_reset.wait();
+	this->release_arena_slot();
+	if (m_shared_memory_fd >= 0)
+		close(m_shared_memory_fd);
+	if (m_vcpu_pool_size != 0 && this->release_pooled_vm())
+		return;
 	vcpu.deinit();
 	close(this->fd);
 }
 
+bool Machine::acquire_pooled_vm(const MachineOptions& options)
+{
+	auto& vms = vm_pool.vms;
+	for (auto it = vms.rbegin(); it != vms.rend(); ++it)
+	{
+		if (it->dirty_ring_request != m_dirty_ring_request
+			|| it->vcpu.use_lapic_timer != options.lapic_timeouts)
+			continue;
+		this->fd = it->fd;
+		this->vcpu.adopt_resources(it->vcpu);
+		this->memory.dirty_ring_entries = it->dirty_ring_entries;
+		vms.erase(std::next(it).base());
+		return true;
+	}
+	return false;
+}
+
+bool Machine::release_pooled_vm()
+{
+	/* SMP vCPUs cannot be created again on the same VM, and the
+	   timer must signal the thread that owns the pool. */
+	if (!m_forked || m_smp != nullptr || vm_pool.vms.size() >= m_vcpu_pool_size)
+		return false;
+	if (vcpu.timer_id != nullptr && vcpu.timer_tid != gettid())
+		return false;
+	try {
+		while (!m_memory_slots.empty())
+			this->delete_memory(m_memory_slots.back());
+		/* Entries left in the dirty ring belong to this VM */
+		std::vector<uint64_t> stale;
+		vcpu.harvest_dirty_ring(stale);
+		/* Breakpoints and single-stepping may have been enabled */
+		struct kvm_guest_debug dbg {};
+		if (ioctl(vcpu.fd, KVM_SET_GUEST_DEBUG, &dbg) < 0)
+			return false;
+		/* A timeout may have left a timer interrupt behind */
+		vcpu.reset_interrupt_state();
+	} catch (...) {
+		return false;
+	}
+	vcpu.timer_ticks = 0;
+	vm_pool.vms.push_back(PooledVM{
+		.fd = this->fd,
+		.vcpu = this->vcpu,
+		.dirty_ring_request = m_dirty_ring_request,
+		.dirty_ring_entries = memory.dirty_ring_entries,
+	});
+	return true;
+}
+
 void Machine::reset_to(std::string_view binary, const MachineOptions& options)
 {
 	ScopedProfiler<MachineProfiling::Reset> prof(this->profiling());
@@ -207,6 +319,7 @@ bool Machine::reset_to(const Machine& other, const MachineOptions& options)
 		/* This could be dangerous, but we will allow it anyway,
 		   for those who dare to mutate an existing VM in prod. */
 		this->m_binary = other.m_binary;
+		this->m_symbols = other.m_symbols;
 		this->m_image_base    = other.m_image_base;
 		this->m_stack_address = other.m_stack_address;
 		this->m_heap_address  = other.m_heap_address;
@@ -226,11 +339,19 @@ bool Machine::reset_to(const Machine& other, const MachineOptions& options)
 		full_reset = true;
 	} else {
 		full_reset = memory.fork_reset(other, options);
+		if (!full_reset && options.reset_merge_hugepages_interval != 0) {
+			this->merge_private_hugepages(options);
+		}
 	}
 
 	this->m_just_reset = full_reset;
 	this->m_mmap_cache = other.m_mmap_cache;
 	this->vcpu.last_fault_address = 0;
+	if (UNLIKELY(m_arena != other.m_arena)) {
+		this->release_arena_slot();
+		this->m_arena = other.m_arena;
+		this->m_arena_begin = other.m_arena_begin;
+	}
 
 	if (other.has_threads() && has_threads()) {
 		this->m_mt->reset_to(*other.m_mt);
@@ -245,7 +366,9 @@ bool Machine::reset_to(const Machine& other, const MachineOptions& options)
 
 	if (full_reset) {
 		this->setup_cow_mode(&other);
+		this->prefault_warm_set(other);
 	}
+	this->memory.banks.refill_zeroed_pages();
 
 	if (options.reset_copy_all_registers) {
 		/* Copy register state from the master machine */
@@ -261,6 +384,49 @@ bool Machine::reset_to(const Machine& other, const MachineOptions& options)
 	return full_reset;
 }
 
+/* Helper threads for reset_to_in_background() */
+static ThreadPool& background_reset_pool()
+{
+	static ThreadPool pool { std::max(1u, std::thread::hardware_concurrency() / 4), 0, true };
+	return pool;
+}
+
+void Machine::reset_to_in_background(const Machine& other, const MachineOptions& options)
+{
+	if (m_background_reset.valid())
+		this->wait_for_reset();
+	m_background_reset = background_reset_pool().enqueue(
+		[this, &other, options] {
+			return this->reset_to(other, options);
+		});
+}
+
+bool Machine::wait_for_reset()
+{
+	if (!m_background_reset.valid())
+		return false;
+	auto reset = std::move(m_background_reset);
+	const bool full_reset = reset.get();
+	/* The reset may have been done on another thread */
+	this->migrate_to_this_thread();
+	return full_reset;
+}
+
+void Machine::merge_private_hugepages(const MachineOptions& options)
+{
+	if (++memory.resets_since_hugepage_merge < options.reset_merge_hugepages_interval)
+		return;
+	memory.resets_since_hugepage_merge = 0;
+
+	const size_t regions = memory.merge_private_pages_into_hugepages();
+	if (regions > 0) {
+		if (auto* prof = this->profiling())
+			prof->hugepage_regions_merged += regions;
+		/* Reloading CR3 flushes the stale 4k TLB entries */
+		vcpu.set_special_registers(this->get_special_registers());
+	}
+}
+
 uint64_t Machine::stack_push(__u64& sp, const void* data, size_t length)
 {
 	sp = (sp - length) & ~(uint64_t) 0x7; // maintain word alignment
@@ -288,11 +454,12 @@ uint64_t Machine::stack_push_cstr(__u64& sp, const char* string, size_t length)
 }
 
 void Machine::install_memory(uint32_t idx, const VirtualMem& mem,
-	[[maybe_unused]] bool readonly)
+	[[maybe_unused]] bool readonly, bool log_dirty)
 {
 	const struct kvm_userspace_memory_region memreg {
 		.slot = idx,
-		.flags = readonly ? (uint32_t)KVM_MEM_READONLY : 0u,
+		.flags = (readonly ? (uint32_t)KVM_MEM_READONLY : 0u)
+			| (log_dirty ? (uint32_t)KVM_MEM_LOG_DIRTY_PAGES : 0u),
 		.guest_phys_addr = mem.physbase,
 		.memory_size = mem.size,
 		.userspace_addr = (uintptr_t) mem.ptr,
@@ -305,6 +472,8 @@ void Machine::install_memory(uint32_t idx, const VirtualMem& mem,
 	if (UNLIKELY(ioctl(this->fd, KVM_SET_USER_MEMORY_REGION, &memreg) < 0)) {
 		throw MemoryException("Failed to install guest memory region", mem.physbase, mem.size);
 	}
+	if (std::find(m_memory_slots.begin(), m_memory_slots.end(), idx) == m_memory_slots.end())
+		m_memory_slots.push_back(idx);
 }
 void Machine::delete_memory(uint32_t idx)
 {
@@ -321,6 +490,7 @@ void Machine::delete_memory(uint32_t idx)
 	if (UNLIKELY(ioctl(this->fd, KVM_SET_USER_MEMORY_REGION, &memreg) < 0)) {
 		machine_exception("Failed to delete guest memory region", idx);
 	}
+	std::erase(m_memory_slots, idx);
 }
 uint64_t Machine::translate(uint64_t virt) const
 {
@@ -428,4 +598,39 @@ int Machine::create_kvm_vm()
 	return fd;
 }
 
+__attribute__ ((cold))
+uint32_t Machine::enable_dirty_ring(int vmfd, uint32_t entries)
+{
+	/* The ring size is in bytes, and must be a power of two
+	   no smaller than a page, and no larger than KVM allows. */
+	const int max_bytes = ioctl(vmfd, KVM_CHECK_EXTENSION, KVM_CAP_DIRTY_LOG_RING);
+	if (max_bytes <= 0)
+		return 0;
+	uint32_t bytes = 4096;
+	while (bytes < entries * sizeof(struct kvm_dirty_gfn) && bytes < uint32_t(max_bytes))
+		bytes <<= 1;
+	struct kvm_enable_cap cap {};
+	cap.cap = KVM_CAP_DIRTY_LOG_RING;
+	cap.args[0] = bytes;
+	if (ioctl(vmfd, KVM_ENABLE_CAP, &cap) < 0)
+		return 0;
+	return bytes / sizeof(struct kvm_dirty_gfn);
+}
+
+__attribute__ ((cold))
+void Machine::enable_split_irqchip(int vmfd)
+{
+	/* Only the local APICs are emulated in the kernel, with no
+	   PIC or IOAPIC, as they are only used for timer interrupts. */
+	if (ioctl(vmfd, KVM_CHECK_EXTENSION, KVM_CAP_SPLIT_IRQCHIP) <= 0) {
+		throw MachineException("KVM does not support a split IRQ chip (local APIC timeouts)");
+	}
+	struct kvm_enable_cap cap {};
+	cap.cap = KVM_CAP_SPLIT_IRQCHIP;
+	cap.args[0] = 0; /* No IOAPIC routes */
+	if (ioctl(vmfd, KVM_ENABLE_CAP, &cap) < 0) {
+		throw MachineException("Failed to enable split IRQ chip (local APIC timeouts)");
+	}
+}
+
 }
@@ -9,6 +9,7 @@
 #include <array>
 #include <cassert>
 #include <functional>
+#include <future>
 #include <memory>
 #include <span>
 #include <vector>
@@ -56,6 +57,15 @@ struct Machine
 	bool stopped() const noexcept { return vcpu.stopped; }
 	bool reset_to(const Machine&, const MachineOptions&); // true = full reset
 	void reset_to(std::string_view binary, const MachineOptions&);
+	/* Queue reset_to() of this fork on a low priority helper thread,
+	   so that it is already clean when it is needed again. The fork
+	   must not be used until wait_for_reset() has returned, and the
+	   source Machine must outlive the reset. */
+	void reset_to_in_background(const Machine&, const MachineOptions&);
+	/* Wait for a background reset and migrate the VM to this thread.
+	   Returns the result of reset_to(), or rethrows its exception. */
+	bool wait_for_reset();
+	bool has_background_reset() const noexcept { return m_background_reset.valid(); }
 
 	/* When zeroes == true, new pages will be zeroed instead of duplicated */
 	void copy_to_guest(address_t addr, const void*, size_t, bool zeroes = false);
@@ -124,6 +134,19 @@ struct Machine
 	template <typename T>
 	uint64_t stack_push_std_array(__u64& sp, const T&, size_t N = T::size());
 
+	/* Reserve an argument arena at the top of the memory of a master VM,
+	   before prepare_copy_on_write(). The arena stays shared with forks,
+	   and each VM claims one of @slots slots on first use. vmcall string
+	   arguments are written directly into the slot, with no CoW faults. */
+	void prepare_argument_arena(size_t bytes_per_slot, unsigned slots);
+	bool has_argument_arena() const noexcept { return m_arena != nullptr; }
+	/* Allocate from the arena slot of this VM. Returns the guest address
+	   and host memory, or {0, nullptr} when the slot is full or missing.
+	   Allocations are recycled after the vmcall they were passed to. */
+	std::pair<address_t, char*> arena_allocate(size_t bytes);
+	/* Push to the arena slot, falling back to the stack. */
+	uint64_t arena_push(__u64& sp, const void*, size_t);
+
 	/* Debugging */
 	long step_one();
 	long run_with_breakpoints(std::array<uint64_t, 4> bps);
@@ -222,7 +245,7 @@ struct Machine
 	};
 	void print_remote_gdb_backtrace(const std::string& filename, const RemoteGDBOptions& opts);
 
-	void install_memory(uint32_t idx, const VirtualMem&, bool ro);
+	void install_memory(uint32_t idx, const VirtualMem&, bool ro, bool log_dirty = false);
 	void delete_memory(uint32_t idx);
 	vMemory& main_memory() noexcept;
 	const vMemory& main_memory() const noexcept;
@@ -236,6 +259,12 @@ struct Machine
 	size_t banked_memory_allocated_bytes() const noexcept { return banked_memory_allocated_pages() * vMemory::PageSize(); }
 	size_t banked_memory_capacity_pages() const noexcept; // How many pages is the VM allowed to allocate in total
 	size_t banked_memory_capacity_bytes() const noexcept { return banked_memory_capacity_pages() * vMemory::PageSize(); }
+	/* The number of 2MB regions merged into hugepages, see reset_merge_hugepages_interval. */
+	size_t merged_hugepage_regions() const noexcept { return memory.merged_hugepage_regions; }
+	/* Whether resets use the KVM dirty ring, see reset_dirty_ring_entries. */
+	bool has_dirty_ring() const noexcept { return memory.dirty_ring_entries != 0; }
+	/* The number of dirty ring entries harvested by resets. */
+	size_t dirty_ring_harvested() const noexcept { return memory.dirty_ring_harvested; }
 
 	template <typename... Args> constexpr
 	void setup_call(tinykvm_x86regs&, uint64_t addr, uint64_t rsp, Args&&... args);
@@ -249,6 +278,12 @@ struct Machine
 	bool is_forked() const noexcept { return m_forked; }
 	bool uses_cow_memory() const noexcept { return m_forked || m_prepped; }
 	std::vector<std::pair<uint64_t, uint64_t>> get_accessed_pages() const;
+	/* Record the pages touched by a training request (from eg. a
+	   fork's get_accessed_pages()) as the warm set of this VM. Forks
+	   of this VM will pre-populate the copy-on-write pages in the warm
+	   set when created and on full resets, avoiding page fault exits. */
+	void set_warm_set(const std::vector<std::pair<uint64_t, uint64_t>>& pages);
+	size_t warm_set_pages() const noexcept { return m_warm_set.size(); }
 
 	/* Remote VM through address space merging */
 	void remote_connect(Machine& other, bool connect_now = false);
@@ -259,6 +294,10 @@ struct Machine
 	void ipre_permanent_remote_resume_now(bool store_fsbase_rdi = true);
 	address_t remote_disconnect();
 	bool has_remote() const noexcept { return m_remote != nullptr; }
+	/* The snapshot this VM was loaded from was paired with a remote.
+	   Load the remote from its own snapshot, and call remote_connect()
+	   with it, which checks that its memory matches the pairing. */
+	bool has_snapshot_remote() const noexcept { return m_snapshot_remote.size != 0; }
 	bool is_remote_connected() const noexcept;
 	bool is_foreign_address(address_t addr) const noexcept;
 	uint32_t remote_connection_count() const noexcept { return m_remote_connections; }
@@ -301,8 +340,34 @@ struct Machine
 	void migrate_to_this_thread();
 	/* Store non-memory VM state to the already existing cold
 	   start state area in memory. Any failure will throw an
-	   exception. The memory must have been pre-allocated. */
+	   exception. The memory must have been pre-allocated.
+	   The populate pages are prefetched in the given order when
+	   the snapshot is loaded, so list the first accessed first. */
 	void save_snapshot_state_now(const std::vector<std::pair<uint64_t, uint64_t>>& populate_pages = {}) const;
+	/* Move the main memory of a master VM prepared with no working
+	   memory (prepare_copy_on_write(0)) into a sealed memfd, and
+	   return it. Other processes can then create a master from it
+	   with MachineOptions::snapshot_file set to /proc/<pid>/fd/<fd>
+	   and snapshot_mode Open. All such masters share the same
+	   physical pages. The memfd is closed with this Machine. */
+	int share_main_memory();
+	/* Write the main memory pages that differ from the snapshot
+	   (and deltas) this VM was loaded from to a new delta snapshot,
+	   along with the current VM state. Written pages, including those
+	   written by the host, are found from /proc/self/pagemap, or else
+	   from the dirty bits in the page tables, which only see guest
+	   writes. Load it with MachineOptions::snapshot_deltas. */
+	void save_snapshot_delta(const std::string& filename,
+		const std::vector<std::pair<uint64_t, uint64_t>>& populate_pages = {}) const;
+	/* Write main memory and the VM state to a compressed snapshot,
+	   with each page compressed on its own, using zstd or else zlib.
+	   The codec is recorded in the file, and builds without it will
+	   refuse to load it. Load it by passing it as
+	   MachineOptions::snapshot_file, and pages are then decompressed
+	   on first access through userfaultfd, or all at once when
+	   userfaultfd is not available. */
+	void save_compressed_snapshot(const std::string& filename,
+		const std::vector<std::pair<uint64_t, uint64_t>>& populate_pages = {}) const;
 	/* Check if the VM was loaded from a snapshot state. */
 	bool has_snapshot_state() const noexcept { return m_loaded_from_snapshot; }
 	/* Get pointer to user area in snapshot state memory, or nullptr
@@ -328,22 +393,35 @@ private:
 	bool relocate_relr_section(const char* section_name);
 	void setup_long_mode(const MachineOptions&);
 	void setup_cow_mode(const Machine*); // After prepare_copy_on_write and forking
+	void prefault_warm_set(const Machine& other);
+	void merge_private_hugepages(const MachineOptions&);
 	[[noreturn]] static void machine_exception(const char*, uint64_t = 0);
 	[[noreturn]] static void timeout_exception(const char*, uint32_t = 0);
 	void smp_vcpu_broadcast(std::function<void(vCPU&)>);
 	address_t remote_activate_now();
 	void remote_pfault_permanent_ipre(uint64_t return_stack, uint64_t return_address);
 	void remote_update_gigapage_mappings(Machine& other, bool forced = false);
+	void release_arena_slot();
 	/* Prepare for resume with a pagetable reload */
 	void prepare_vmresume(address_t fsbase = 0, bool reload_pagetables = true);
 	bool load_snapshot_state();
+	void save_snapshot_state_to(void* area, const std::vector<std::pair<uint64_t, uint64_t>>& populate_pages = {}) const;
+	void assign_binary(std::string_view binary);
 
 	vCPU  vcpu;
 	int   fd = 0;
+	uint32_t m_vcpu_pool_size = 0;
+	uint32_t m_dirty_ring_request = 0;
+	/* Installed memory slots, deleted before a VM is pooled */
+	std::vector<uint32_t> m_memory_slots;
+	std::future<bool> m_background_reset;
+	/* The snapshot file and deltas that this VM was loaded from */
+	std::vector<std::string> m_snapshot_layers;
 	bool  m_prepped = false;
 	bool  m_forked = false;
 	bool  m_just_reset = false;
 	bool  m_loaded_from_snapshot = false;
+	int   m_shared_memory_fd = -1;
 	bool  m_remote_pfaults = false;
 	bool  m_permanent_remote_connection = false;
 	bool  m_relocate_fixed_mmap = false;
@@ -353,6 +431,8 @@ private:
 	void* m_userdata = nullptr;
 
 	std::string_view m_binary;
+	/* Symbol lookups for m_binary, shared with forks */
+	std::shared_ptr<struct SymbolIndex> m_symbols = nullptr;
 
 	vMemory memory;  // guest memory
 
@@ -365,6 +445,14 @@ private:
 	address_t m_kernel_end;
 
 	MMapCache m_mmap_cache;
+	/* Writable copy-on-write pages that forks will pre-populate */
+	std::vector<uint64_t> m_warm_set;
+	/* Zero-copy vmcall arguments, shared with forks */
+	std::shared_ptr<struct ArgumentArena> m_arena = nullptr;
+	address_t m_arena_begin = UINT64_MAX;
+	int32_t m_arena_slot = -1;
+	size_t m_arena_used = 0;
+	bool  m_arena_recycle = false;
 	mutable std::unique_ptr<MultiThreading> m_mt;
 
 	mutable std::unique_ptr<SMP> m_smp;
@@ -373,6 +461,11 @@ private:
 
 	Machine* m_remote = nullptr;
 	uint32_t m_remote_connections = 0;
+	/* Remote main memory at the time the loaded snapshot was saved */
+	struct {
+		address_t physbase = 0;
+		size_t    size = 0;
+	} m_snapshot_remote;
 
 	std::unique_ptr<MachineProfiling> m_profiling = nullptr;
 
@@ -388,6 +481,10 @@ private:
 	static mmap_func_t        m_mmap_func;
 
 	static int create_kvm_vm();
+	static uint32_t enable_dirty_ring(int vmfd, uint32_t entries);
+	static void enable_split_irqchip(int vmfd);
+	bool acquire_pooled_vm(const MachineOptions&);
+	bool release_pooled_vm();
 	static int kvm_fd;
 	static void* create_vcpu_timer();
 	friend struct vCPU;
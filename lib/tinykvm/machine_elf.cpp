@@ -1,8 +1,15 @@
 #include "machine.hpp"
 
+#include <algorithm>
 #include <cassert>
 #include <cstring>
+#include <future>
+#include <mutex>
 #include <stdexcept>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <thread>
+#include <unordered_map>
 #ifdef TINYKVM_ARCH_AMD64
 #include "amd64/idt.hpp" // interrupt_header()
 #include "amd64/paging.hpp"
@@ -12,6 +19,9 @@
 namespace tinykvm {
 static constexpr bool VERBOSE_LOADER = false;
 static constexpr int MAX_LOADABLE_SEGMENTS = 16;
+/* Relocation tables are split across threads above this size */
+static constexpr size_t PARALLEL_RELOCATIONS = 32768;
+static constexpr unsigned MAX_RELOCATION_THREADS = 8;
 
 DynamicElf is_dynamic_elf(std::string_view binary)
 {
@@ -88,7 +98,7 @@ void Machine::elf_loader(std::string_view binary, const MachineOptions& options)
 	}
 
 	/* Any old binary no longer relevant, just set new one. */
-	this->m_binary = binary;
+	this->assign_binary(binary);
 
 	const auto* phdr = (Elf64_Phdr*) (binary.data() + elf->e_phoff);
 	this->m_start_address = this->m_image_base + elf->e_entry;
@@ -188,6 +198,78 @@ void Machine::elf_loader(std::string_view binary, const MachineOptions& options)
 	}
 }
 
+/* Map the whole pages of a segment privately from the ELF file, so that
+   they are read on first access and copied on first write. The partial
+   pages at either end are copied. Returns the number of bytes mapped. */
+static size_t load_segment_from_file(char* dst, const char* src, int fd, uint64_t offset, size_t len)
+{
+	const uintptr_t begin = ((uintptr_t)dst + PageMask()) & ~PageMask();
+	const uintptr_t end = ((uintptr_t)dst + len) & ~PageMask();
+	const uint64_t file_offset = offset + (begin - (uintptr_t)dst);
+	struct stat st;
+	if (end <= begin || (file_offset & PageMask()) != 0
+		|| fstat(fd, &st) < 0 || uint64_t(st.st_size) < offset + len)
+	{
+		std::memcpy(dst, src, len);
+		return 0;
+	}
+	void* res = mmap((void*)begin, end - begin, PROT_READ | PROT_WRITE,
+		MAP_PRIVATE | MAP_FIXED | MAP_NORESERVE, fd, file_offset);
+	if (res == MAP_FAILED) {
+		/* The old mapping may be gone, so replace it */
+		res = mmap((void*)begin, end - begin, PROT_READ | PROT_WRITE,
+			MAP_ANONYMOUS | MAP_PRIVATE | MAP_FIXED | MAP_NORESERVE, -1, 0);
+		if (res == MAP_FAILED)
+			throw MachineException("Failed to map ELF segment", offset);
+		std::memcpy(dst, src, len);
+		return 0;
+	}
+	std::memcpy(dst, src, begin - (uintptr_t)dst);
+	std::memcpy((char*)end, src + (end - (uintptr_t)dst), (uintptr_t)dst + len - end);
+	return end - begin;
+}
+
+/* Run func(begin, end) over [0, count) split into chunks on separate
+   threads, when there is enough work. The chunk boundaries can be moved
+   forward by @adjust. Exceptions are rethrown on the calling thread. */
+template <typename Adjust, typename Func>
+static void parallel_chunks(size_t count, Adjust adjust, Func func)
+{
+	const unsigned threads = std::min<unsigned>(MAX_RELOCATION_THREADS,
+		std::max(1u, std::thread::hardware_concurrency()));
+	if (count < PARALLEL_RELOCATIONS || threads == 1) {
+		func(0, count);
+		return;
+	}
+	std::vector<size_t> bounds { 0 };
+	for (unsigned i = 1; i < threads; i++) {
+		const size_t b = adjust(std::max(bounds.back(), count * i / threads));
+		if (b < count && b > bounds.back())
+			bounds.push_back(b);
+	}
+	bounds.push_back(count);
+
+	std::vector<std::future<void>> chunks;
+	for (size_t i = 1; i + 1 < bounds.size(); i++) {
+		chunks.push_back(std::async(std::launch::async, func, bounds[i], bounds[i+1]));
+	}
+	std::exception_ptr error = nullptr;
+	try {
+		func(bounds[0], bounds[1]);
+	} catch (...) {
+		error = std::current_exception();
+	}
+	for (auto& chunk : chunks) {
+		try {
+			chunk.get();
+		} catch (...) {
+			if (!error) error = std::current_exception();
+		}
+	}
+	if (error)
+		std::rethrow_exception(error);
+}
+
 void Machine::elf_load_ph(std::string_view binary, const MachineOptions& options, const void* vphdr)
 {
 	const auto* hdr = (const Elf64_Phdr*) vphdr;
@@ -217,7 +299,15 @@ void Machine::elf_load_ph(std::string_view binary, const MachineOptions& options
 		throw MachineException("Bogus ELF segment virtual base", hdr->p_vaddr);
 	}
 	if (memory.safely_within(load_address, len)) {
-		std::memcpy(memory.at(load_address), src, len);
+		char* dst = memory.at(load_address);
+		if (options.binary_fd >= 0 && !options.hugepages && memory.owned && memory.snapshot_fd < 0) {
+			const size_t mapped = load_segment_from_file(dst, src, options.binary_fd, hdr->p_offset, len);
+			if (options.verbose_loader) {
+				printf("* Mapped %zu of %zu bytes from the ELF file\n", mapped, len);
+			}
+		} else {
+			std::memcpy(dst, src, len);
+		}
 	} else {
 		if (options.verbose_loader) {
 			printf("Segment at %p is too large or not safely within physical base at %p. Size: %zu vs %p\n",
@@ -250,7 +340,7 @@ static const Elf64_Sym* elf_sym_index(std::string_view binary, const Elf64_Shdr*
 	auto* symtab = elf_offset<Elf64_Sym>(binary, shdr->sh_offset);
 	return &symtab[symidx];
 }
-static const Elf64_Sym* resolve_symbol(std::string_view binary, const char* name)
+static const Elf64_Sym* resolve_symbol(std::string_view binary, std::string_view name)
 {
 	if (UNLIKELY(binary.empty())) return nullptr;
 	const auto* sym_hdr = section_by_name(binary, ".symtab");
@@ -265,18 +355,194 @@ static const Elf64_Sym* resolve_symbol(std::string_view binary, const char* name
 	for (size_t i = 0; i < symtab_ents; i++)
 	{
 		const char* symname = &strtab[symtab[i].st_name];
-		if (strcmp(symname, name) == 0) {
+		if (symname == name) {
 			return &symtab[i];
 		}
 	}
 	return nullptr;
 }
 
+/* Symbol lookups for one binary, shared by a master and its forks.
+   Exported symbols are found through .gnu.hash right away, while the
+   full .symtab index is built on the first lookup that needs it. */
+struct SymbolIndex
+{
+	SymbolIndex(std::string_view binary);
+	const Elf64_Sym* find(std::string_view name);
+	const Elf64_Sym* find_function(uint64_t addr);
+	const char* name_of(const Elf64_Sym* sym) const;
+
+private:
+	const Elf64_Sym* gnu_hash_find(std::string_view name) const;
+	void build();
+
+	std::string_view m_binary;
+	std::once_flag m_built;
+	const Elf64_Sym* m_symtab = nullptr;
+	size_t m_symtab_ents = 0;
+	const char* m_strtab = nullptr;
+	std::unordered_map<std::string_view, const Elf64_Sym*> m_by_name;
+	std::vector<const Elf64_Sym*> m_functions; /* Sorted by address */
+	/* .gnu.hash table over .dynsym */
+	const uint32_t* m_gnu_hash = nullptr;
+	const Elf64_Sym* m_dynsym = nullptr;
+	size_t m_dynsym_ents = 0;
+	const char* m_dynstr = nullptr;
+	size_t m_dynstr_size = 0;
+};
+
+SymbolIndex::SymbolIndex(std::string_view binary)
+	: m_binary(binary)
+{
+	const auto* hash_hdr = section_by_name(binary, ".gnu.hash");
+	const auto* dynsym_hdr = section_by_name(binary, ".dynsym");
+	const auto* dynstr_hdr = section_by_name(binary, ".dynstr");
+	if (hash_hdr == nullptr || dynsym_hdr == nullptr || dynstr_hdr == nullptr)
+		return;
+	try {
+		/* nbuckets, symoffset, bloom_size, bloom_shift */
+		const auto* hash = elf_offset_array<uint32_t>(binary, hash_hdr->sh_offset, 4);
+		const size_t dynsym_ents = dynsym_hdr->sh_size / sizeof(Elf64_Sym);
+		const size_t words = 4 + hash[2] * 2ul + hash[0] + (dynsym_ents - hash[1]);
+		if (hash[0] == 0 || hash[2] == 0 || hash[1] > dynsym_ents || words * 4 > hash_hdr->sh_size)
+			return;
+		this->m_dynsym = elf_offset_array<Elf64_Sym>(binary, dynsym_hdr->sh_offset, dynsym_ents);
+		this->m_dynstr = elf_offset_array<char>(binary, dynstr_hdr->sh_offset, dynstr_hdr->sh_size);
+		this->m_dynstr_size = dynstr_hdr->sh_size;
+		this->m_gnu_hash = elf_offset_array<uint32_t>(binary, hash_hdr->sh_offset, words);
+		this->m_dynsym_ents = dynsym_ents;
+	} catch (const MachineException&) {
+		/* Fall back to the symbol table */
+		this->m_gnu_hash = nullptr;
+	}
+}
+
+const Elf64_Sym* SymbolIndex::gnu_hash_find(std::string_view name) const
+{
+	uint32_t h = 5381;
+	for (const char c : name)
+		h = h * 33 + uint8_t(c);
+
+	const uint32_t nbuckets = m_gnu_hash[0];
+	const uint32_t symoffset = m_gnu_hash[1];
+	const uint32_t bloom_size = m_gnu_hash[2];
+	const uint32_t bloom_shift = m_gnu_hash[3];
+	const auto* bloom = (const uint64_t*)&m_gnu_hash[4];
+	const auto* buckets = &m_gnu_hash[4 + bloom_size * 2];
+	const auto* chain = &buckets[nbuckets];
+
+	const uint64_t word = bloom[(h / 64) % bloom_size];
+	const uint64_t mask = (1ul << (h % 64)) | (1ul << ((h >> bloom_shift) % 64));
+	if ((word & mask) != mask)
+		return nullptr;
+
+	for (uint32_t idx = buckets[h % nbuckets]; idx >= symoffset && idx < m_dynsym_ents; idx++)
+	{
+		const uint32_t h2 = chain[idx - symoffset];
+		const auto& sym = m_dynsym[idx];
+		if ((h | 1) == (h2 | 1) && sym.st_shndx != SHN_UNDEF
+			&& sym.st_name + name.size() < m_dynstr_size
+			&& std::string_view(m_dynstr + sym.st_name, name.size()) == name
+			&& m_dynstr[sym.st_name + name.size()] == 0)
+			return &sym;
+		if (h2 & 1)
+			break;
+	}
+	return nullptr;
+}
+
+void SymbolIndex::build()
+{
+	const auto* sym_hdr = section_by_name(m_binary, ".symtab");
+	const auto* str_hdr = section_by_name(m_binary, ".strtab");
+	/* Stripped binaries may still have dynamic symbols */
+	if (sym_hdr == nullptr || str_hdr == nullptr) {
+		sym_hdr = section_by_name(m_binary, ".dynsym");
+		str_hdr = section_by_name(m_binary, ".dynstr");
+	}
+	if (sym_hdr == nullptr || str_hdr == nullptr)
+		return;
+	this->m_symtab_ents = sym_hdr->sh_size / sizeof(Elf64_Sym);
+	this->m_symtab = elf_offset_array<Elf64_Sym>(m_binary, sym_hdr->sh_offset, m_symtab_ents);
+	this->m_strtab = elf_offset_array<char>(m_binary, str_hdr->sh_offset, str_hdr->sh_size);
+
+	m_by_name.reserve(m_symtab_ents);
+	for (size_t i = 0; i < m_symtab_ents; i++)
+	{
+		const auto& sym = m_symtab[i];
+		if (sym.st_name >= str_hdr->sh_size)
+			continue;
+		const std::string_view name { &m_strtab[sym.st_name],
+			strnlen(&m_strtab[sym.st_name], str_hdr->sh_size - sym.st_name) };
+		/* The first symbol with a name wins, like a linear scan */
+		if (!name.empty())
+			m_by_name.try_emplace(name, &sym);
+		/* Only look at functions (for now). Old-style symbols have no FUNC. */
+		if (sym.st_info & STT_FUNC)
+			m_functions.push_back(&sym);
+	}
+	std::stable_sort(m_functions.begin(), m_functions.end(),
+		[] (const Elf64_Sym* a, const Elf64_Sym* b) {
+			return a->st_value < b->st_value;
+		});
+}
+
+const Elf64_Sym* SymbolIndex::find(std::string_view name)
+{
+	if (m_gnu_hash != nullptr) {
+		if (const auto* sym = gnu_hash_find(name))
+			return sym;
+	}
+	std::call_once(m_built, &SymbolIndex::build, this);
+	auto it = m_by_name.find(name);
+	return (it != m_by_name.end()) ? it->second : nullptr;
+}
+
+const Elf64_Sym* SymbolIndex::find_function(uint64_t addr)
+{
+	std::call_once(m_built, &SymbolIndex::build, this);
+	auto it = std::upper_bound(m_functions.begin(), m_functions.end(), addr,
+		[] (uint64_t addr, const Elf64_Sym* sym) {
+			return addr < sym->st_value;
+		});
+	if (it == m_functions.begin())
+		return nullptr;
+	/* The closest preceding functions, looking for one that contains
+	   the address (aliases and nested symbols share addresses). */
+	const Elf64_Sym* closest = *std::prev(it);
+	for (int n = 0; n < 16 && it != m_functions.begin(); n++) {
+		const auto* sym = *--it;
+		if (addr < sym->st_value + sym->st_size)
+			return sym;
+	}
+	return closest;
+}
+
+const char* SymbolIndex::name_of(const Elf64_Sym* sym) const
+{
+	if (sym >= m_dynsym && sym < m_dynsym + m_dynsym_ents)
+		return &m_dynstr[sym->st_name];
+	return &m_strtab[sym->st_name];
+}
+
+void Machine::assign_binary(std::string_view binary)
+{
+	this->m_binary = binary;
+	this->m_symbols = std::make_shared<SymbolIndex>(binary);
+}
+
 uint64_t Machine::address_of(std::string_view name, std::string_view binary) const
 {
-	if (binary.empty())
-		binary = this->m_binary;
-	const auto* sym = resolve_symbol(binary, name.data());
+	const Elf64_Sym* sym = nullptr;
+	if (binary.empty() || binary.data() == m_binary.data()) {
+		if (UNLIKELY(m_symbols == nullptr)) {
+			sym = resolve_symbol(m_binary, name);
+		} else {
+			sym = m_symbols->find(name);
+		}
+	} else {
+		sym = resolve_symbol(binary, name);
+	}
 	return (sym) ? this->m_image_base + sym->st_value : 0x0;
 }
 uint64_t Machine::address_of(std::string_view name, const std::vector<uint8_t>& binary) const
@@ -286,7 +552,7 @@ uint64_t Machine::address_of(std::string_view name, const std::vector<uint8_t>&
 }
 uint64_t Machine::AddressOf(std::string_view symbol, std::string_view binary)
 {
-	const auto* sym = resolve_symbol(binary, symbol.data());
+	const auto* sym = resolve_symbol(binary, symbol);
 	return (sym) ? sym->st_value : 0x0;
 }
 std::string Machine::resolve(uint64_t rip, std::string_view binary) const
@@ -295,55 +561,32 @@ std::string Machine::resolve(uint64_t rip, std::string_view binary) const
 		binary = m_binary;
 
 	if (UNLIKELY(binary.empty())) return "(no binary)";
-	const auto* sym_hdr = section_by_name(binary, ".symtab");
-	if (UNLIKELY(sym_hdr == nullptr)) return "(no symbols)";
-	const auto* str_hdr = section_by_name(binary, ".strtab");
-	if (UNLIKELY(str_hdr == nullptr)) return "(no strings)";
-
 	if (UNLIKELY(rip < this->m_image_base)) return "(error: rip < image base)";
 	const address_t relative_rip = rip - this->m_image_base;
 
-	const auto* symtab = elf_sym_index(binary, sym_hdr, 0);
-	const size_t symtab_ents = sym_hdr->sh_size / sizeof(Elf64_Sym);
-	const char* strtab = elf_offset<char>(binary, str_hdr->sh_offset);
-
-	char result[2048];
-	uint64_t second_best_address = ~0ULL;
-	const Elf64_Sym* second_best = nullptr;
-	for (size_t i = 0; i < symtab_ents; i++)
-	{
-		/* Only look at functions (for now). Old-style symbols have no FUNC. */
-		if (symtab[i].st_info & STT_FUNC) {
-			/* Direct matches only (for now) */
-			if (relative_rip >= symtab[i].st_value && relative_rip < symtab[i].st_value + symtab[i].st_size)
-			{
-				const uint64_t offset = relative_rip - symtab[i].st_value;
-				int len = snprintf(result, sizeof(result),
-					"%s + 0x%lX", &strtab[symtab[i].st_name], offset);
-				if (len > 0)
-					return std::string(result, len);
-				else
-					return std::string(&strtab[symtab[i].st_name]);
-			}
-			else if (relative_rip >= symtab[i].st_value && second_best_address > symtab[i].st_value)
-			{
-				// We found a better match, but not exact
-				second_best_address = symtab[i].st_value;
-				second_best = &symtab[i];
-			}
-		}
+	/* Other binaries get a temporary index */
+	std::shared_ptr<SymbolIndex> temporary;
+	SymbolIndex* index = m_symbols.get();
+	if (binary.data() != m_binary.data() || index == nullptr) {
+		if (UNLIKELY(section_by_name(binary, ".symtab") == nullptr)) return "(no symbols)";
+		if (UNLIKELY(section_by_name(binary, ".strtab") == nullptr)) return "(no strings)";
+		temporary = std::make_shared<SymbolIndex>(binary);
+		index = temporary.get();
 	}
-	/// If we didn't find a direct match, return the closest one
-	if (second_best != nullptr) {
-		int len = snprintf(result, sizeof(result),
-			"%s + 0x%lX", &strtab[second_best->st_name],
-			relative_rip - second_best->st_value);
-		if (len > 0)
-			return std::string(result, len);
-		else
-			return std::string(&strtab[second_best->st_name]);
+
+	const auto* sym = index->find_function(relative_rip);
+	if (sym == nullptr) {
+		if (UNLIKELY(section_by_name(binary, ".symtab") == nullptr)) return "(no symbols)";
+		return "(unknown)";
 	}
-	return "(unknown)";
+	const char* name = index->name_of(sym);
+	char result[2048];
+	int len = snprintf(result, sizeof(result),
+		"%s + 0x%lX", name, relative_rip - sym->st_value);
+	if (len > 0)
+		return std::string(result, std::min(size_t(len), sizeof(result) - 1));
+	else
+		return std::string(name);
 }
 
 bool Machine::relocate_section(const char* section_name, const char* sym_section)
@@ -364,7 +607,10 @@ bool Machine::relocate_section(const char* section_name, const char* sym_section
 	}
 
 	auto* rela_addr = elf_offset_array<Elf64_Rela>(m_binary, rela->sh_offset, rela_ents);
-	for (size_t i = 0; i < rela_ents; i++)
+	/* Each relocation writes its own target, so they can be split freely */
+	parallel_chunks(rela_ents, [] (size_t i) { return i; },
+	[&] (size_t begin, size_t end) {
+	for (size_t i = begin; i < end; i++)
 	{
 		const auto rtype = ELF64_R_TYPE(rela_addr[i].r_info);
 		if (rtype != R_X86_64_RELATIVE && rtype != R_X86_64_IRELATIVE) {
@@ -390,6 +636,7 @@ bool Machine::relocate_section(const char* section_name, const char* sym_section
 			}
 		}
 	}
+	});
 	return true;
 }
 
@@ -406,8 +653,17 @@ bool Machine::relocate_relr_section(const char* section_name)
 	const size_t relr_ents = relr->sh_size / sizeof(Elf64_Addr);
 	auto* relr_addr = elf_offset_array<Elf64_Addr>(m_binary, relr->sh_offset, relr_ents);
 
+	/* Bitmap entries continue from the previous entry, so chunks
+	   must begin with an address entry. */
+	parallel_chunks(relr_ents,
+	[relr_addr, relr_ents] (size_t i) {
+		while (i < relr_ents && (relr_addr[i] & 1ULL) != 0)
+			i++;
+		return i;
+	},
+	[&] (size_t begin, size_t end) {
 	address_t where = 0;
-	for (size_t i = 0; i < relr_ents; i++)
+	for (size_t i = begin; i < end; i++)
 	{
 		const uint64_t entry = relr_addr[i];
 		if ((entry & 1ULL) == 0)
@@ -444,6 +700,7 @@ bool Machine::relocate_relr_section(const char* section_name)
 			where += 63 * sizeof(address_t);
 		}
 	}
+	});
 	return true;
 }
 
@@ -64,31 +64,37 @@ void Machine::setup_call(tinykvm_x86regs& regs,
 	}
 	regs.rsp = rsp;
 	[[maybe_unused]] unsigned iargs = 0;
+	[[maybe_unused]] auto arg_register = [&regs] (unsigned idx) -> unsigned long long& {
+		if (idx == 0)
+			return regs.rdi;
+		else if (idx == 1)
+			return regs.rsi;
+		else if (idx == 2)
+			return regs.rdx;
+		else if (idx == 3)
+			return regs.rcx;
+		else if (idx == 4)
+			return regs.r8;
+		else if (idx == 5)
+			return regs.r9;
+		throw MachineException("Too many vmcall arguments");
+	};
 	([&] {
-		auto& reg = [iargs, &regs] () mutable -> unsigned long long& {
-			if (iargs == 0)
-				return regs.rdi;
-			else if (iargs == 1)
-				return regs.rsi;
-			else if (iargs == 2)
-				return regs.rdx;
-			else if (iargs == 3)
-				return regs.rcx;
-			else if (iargs == 4)
-				return regs.r8;
-			else if (iargs == 5)
-				return regs.r9;
-			throw MachineException("Too many vmcall arguments");
-		}();
+		auto& reg = arg_register(iargs);
 		if constexpr (std::is_integral_v<std::remove_cvref_t<Args>>) {
 			reg = args;
 			iargs ++;
-		} else if constexpr (is_stdstring<Args>::value) {
-			reg = stack_push(regs.rsp, args.c_str(), args.size()+1);
+		} else if constexpr (is_stdstring<std::remove_cvref_t<Args>>::value) {
+			reg = arena_push(regs.rsp, args.c_str(), args.size()+1);
 			iargs ++;
 		} else if constexpr (is_string<Args>::value) {
-			reg = stack_push_cstr(regs.rsp, args);
+			reg = arena_push(regs.rsp, args, std::string_view(args).size()+1);
 			iargs ++;
+		} else if constexpr (std::is_same_v<std::remove_cvref_t<Args>, ArgumentBuffer>) {
+			/* Pointer and length, taking two argument registers */
+			reg = arena_push(regs.rsp, args.data, args.size);
+			arg_register(iargs + 1) = args.size;
+			iargs += 2;
 		} else if constexpr (std::is_pod_v<std::remove_reference<Args>>) {
 			reg = stack_push(regs.rsp, args);
 			iargs ++;
@@ -101,6 +107,8 @@ void Machine::setup_call(tinykvm_x86regs& regs,
 	regs.rsp &= ~(uint64_t) 0xF;
 	/* Push return value last */
 	stack_push<uint64_t> (regs.rsp, exit_address());
+	/* Arena allocations may be recycled after this call */
+	this->m_arena_recycle = true;
 	/* VM needs to be in user-mode to make a vmcall. */
 	this->enter_usermode();
 }
@@ -1,5 +1,8 @@
 #include "machine.hpp"
 
+#include <algorithm>
+#include <cerrno>
+#include <cstdio>
 #include <cstring>
 #include <fcntl.h>
 #include <linux/kvm.h>
@@ -15,6 +18,10 @@
 #include "linux/fds.hpp"
 #include "linux/threads.hpp"
 
+#ifndef MADV_POPULATE_READ
+#define MADV_POPULATE_READ 22
+#endif
+
 namespace tinykvm {
 
 struct ColdStartAccessedRange {
@@ -59,6 +66,105 @@ struct ColdStartSocketPair {
 	int type;
 };
 
+struct ColdStartMmapRanges {
+	uint64_t mmap_physical;
+	uint32_t count;
+};
+struct ColdStartMmapRange {
+	uint64_t physbase;
+	uint64_t virtbase;
+	uint64_t size;
+	uint64_t file_offset;
+	uint64_t file_size;
+	int64_t  file_mtime; // Nanoseconds
+	uint32_t path_len;   // Followed by the path, 8-byte padded
+};
+struct ColdStartRemote {
+	uint64_t physbase;
+	uint64_t size;
+	bool allow_page_faults;
+	bool permanent;
+};
+
+/* A delta snapshot is sparse: It has the size of a full snapshot,
+   but only the listed ranges of main memory are written to it.
+   This header and the ranges follow the cold start state area. */
+struct SnapshotDelta {
+	static constexpr uint32_t MAGIC = 0x564D4344; // 'VMCD'
+	uint32_t magic;
+	uint32_t count;
+	uint64_t memory_size;
+};
+/* Unchanged pages between two changed ranges closer than this are
+   written too, so that loading the delta takes fewer mappings. */
+static constexpr uint64_t SNAPSHOT_DELTA_MERGE_GAP = 16 * vMemory::PageSize();
+
+/* Written pages of a private file mapping are anonymous copies, no
+   matter if the guest or the host wrote them. Appends them as
+   (offset, size) ranges, or returns false if the page map is not
+   available. */
+static bool find_private_pages(const char* ptr, size_t size,
+	std::vector<std::pair<uint64_t, uint64_t>>& ranges)
+{
+	static constexpr size_t PSIZE = vMemory::PageSize();
+	static constexpr uint64_t PM_PRESENT = 1ULL << 63;
+	static constexpr uint64_t PM_SWAP = 1ULL << 62;
+	static constexpr uint64_t PM_FILE = 1ULL << 61;
+	const int fd = open("/proc/self/pagemap", O_RDONLY | O_CLOEXEC);
+	if (fd < 0)
+		return false;
+	std::vector<uint64_t> entries(4096);
+	const size_t pages = size / PSIZE;
+	for (size_t page = 0; page < pages; page += entries.size())
+	{
+		const size_t count = std::min(entries.size(), pages - page);
+		const off_t offset = (uintptr_t(ptr) / PSIZE + page) * sizeof(uint64_t);
+		if (pread(fd, entries.data(), count * sizeof(uint64_t), offset) != ssize_t(count * sizeof(uint64_t))) {
+			close(fd);
+			return false;
+		}
+		for (size_t i = 0; i < count; i++) {
+			if ((entries[i] & (PM_PRESENT | PM_SWAP)) == 0 || (entries[i] & PM_FILE) != 0)
+				continue;
+			const uint64_t addr = (page + i) * PSIZE;
+			if (!ranges.empty() && ranges.back().first + ranges.back().second == addr)
+				ranges.back().second += PSIZE;
+			else
+				ranges.push_back({addr, PSIZE});
+		}
+	}
+	close(fd);
+	return true;
+}
+
+/* Every range mapped into the middle of an existing mapping splits it,
+   adding up to two mappings. Fail before mapping anything when that
+   would exceed vm.max_map_count, instead of part way through. */
+static void check_map_count(size_t ranges, const std::string& filename)
+{
+	size_t max_count = 0;
+	if (FILE* f = fopen("/proc/sys/vm/max_map_count", "r")) {
+		if (fscanf(f, "%zu", &max_count) != 1)
+			max_count = 0;
+		fclose(f);
+	}
+	if (max_count == 0)
+		return;
+	size_t current = 0;
+	if (FILE* f = fopen("/proc/self/maps", "r")) {
+		char buffer[4096];
+		size_t len;
+		while ((len = fread(buffer, 1, sizeof(buffer), f)) > 0)
+			current += std::count(buffer, buffer + len, '\n');
+		fclose(f);
+	}
+	if (current + 2 * ranges > max_count) {
+		throw std::runtime_error("VM snapshot delta needs " + std::to_string(2 * ranges)
+			+ " more memory mappings, which would exceed vm.max_map_count ("
+			+ std::to_string(max_count) + "): " + filename);
+	}
+}
+
 struct SnapshotState {
 	static constexpr uint32_t MAGIC = 0x564D4353; // 'VMCS'
 	uint32_t magic;
@@ -99,7 +205,18 @@ struct SnapshotState {
 		}
 		return ret;
 	}
+	char* next_bytes(void*& current, size_t len) {
+		char* ret = reinterpret_cast<char*>(current);
+		current = ret + ((len + 7) & ~size_t(7));
+		if (reinterpret_cast<char*>(current) > reinterpret_cast<char*>(this) + Size()) {
+			throw std::runtime_error("Out of bounds access on SnapshotState");
+		}
+		return ret;
+	}
 };
+static int64_t file_mtime(const struct stat& st) {
+	return int64_t(st.st_mtim.tv_sec) * 1000000000L + st.st_mtim.tv_nsec;
+}
 bool Machine::load_snapshot_state()
 {
 	if (!memory.has_loadable_snapshot_state()) {
@@ -140,15 +257,23 @@ bool Machine::load_snapshot_state()
 		this->m_mmap_cache.current() = state.mmap_current;
 		this->memory.main_memory_writes = state.main_memory_writes;
 		this->memory.page_tables = state.m_page_tables;
+		this->memory.tlb.invalidate();
 
 		void* current = state.current;
 		// Load populate pages
 		madvise(this->memory.ptr, kernel_end_address(), MADV_WILLNEED | MADV_RANDOM);
 		static const uint64_t step = 1024*1024;
+		std::vector<std::pair<uint64_t, uint64_t>> prefetch;
 		for (unsigned i = 0; i < state.num_access_ranges; i++) {
 			ColdStartAccessedRange* range = state.next<ColdStartAccessedRange>(current);
 			if (range->start >= MemoryBanks::ARENA_BASE_ADDRESS || range->start < kernel_end_address())
 				continue;
+			if (range->end > memory.size || range->start >= range->end)
+				continue;
+			if (memory.snapshot_prefetch) {
+				prefetch.push_back({range->start, range->end});
+				continue;
+			}
 			try {
 				//printf("Populating pages from 0x%lX -> 0x%lX\n", range->start, range->end);
 				for (uint64_t start = range->start; start < range->end; start += step) {
@@ -159,6 +284,9 @@ bool Machine::load_snapshot_state()
 				continue;
 			}
 		}
+		if (!prefetch.empty()) {
+			memory.start_snapshot_prefetch(std::move(prefetch));
+		}
 
 		// Load the thread states
 		ColdStartThreads* threads = state.next<ColdStartThreads>(current);
@@ -204,6 +332,45 @@ bool Machine::load_snapshot_state()
 			fdm.create_epoll_entry_from(centry->vfd, entry);
 		}
 
+		// Older snapshots end here
+		if (reinterpret_cast<char*>(current) < reinterpret_cast<char*>(&state) + state.size) {
+			// Re-map the file-backed ranges at their old physical addresses
+			ColdStartMmapRanges* mranges = state.next<ColdStartMmapRanges>(current);
+			for (uint32_t i = 0; i < mranges->count; i++) {
+				ColdStartMmapRange* cr = state.next<ColdStartMmapRange>(current);
+				const std::string path(state.next_bytes(current, cr->path_len), cr->path_len);
+				struct stat st;
+				if (stat(path.c_str(), &st) != 0 || uint64_t(st.st_size) != cr->file_size
+					|| file_mtime(st) != cr->file_mtime) {
+					throw std::runtime_error("File-backed mapping changed after snapshot: " + path);
+				}
+				const int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+				char* ptr = (char*)MAP_FAILED;
+				if (fd >= 0) {
+					ptr = (char*)mmap(nullptr, cr->size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, cr->file_offset);
+					close(fd);
+				}
+				if (ptr == MAP_FAILED) {
+					throw std::runtime_error("Failed to map file-backed mapping: " + path);
+				}
+				const unsigned region_idx = memory.allocate_region_idx();
+				this->install_memory(region_idx, VirtualMem(cr->physbase, ptr, cr->size), false);
+				memory.mmap_ranges.emplace_back(cr->physbase, ptr, cr->virtbase, cr->size, path);
+				memory.mmap_ranges.back().bank_idx = region_idx;
+				memory.mmap_ranges.back().file_offset = cr->file_offset;
+			}
+			if (mranges->count > 0) {
+				memory.index_mmap_ranges();
+			}
+			memory.mmap_physical = mranges->mmap_physical;
+			// The remote is re-established with remote_connect()
+			ColdStartRemote* cremote = state.next<ColdStartRemote>(current);
+			this->m_snapshot_remote.physbase = cremote->physbase;
+			this->m_snapshot_remote.size = cremote->size;
+			this->m_remote_pfaults = cremote->allow_page_faults;
+			this->m_permanent_remote_connection = cremote->permanent;
+		}
+
 	} catch (const MachineException& me) {
 		fprintf(stderr, "Failed to set cold start state: %s Data: 0x%#lX\n",
 			me.what(), me.data());
@@ -216,7 +383,10 @@ void Machine::save_snapshot_state_now(const std::vector<std::pair<uint64_t, uint
 	if (this->is_forked()) {
 		throw std::runtime_error("Cannot save snapshot state of a forked VM");
 	}
-	void* map = this->memory.get_snapshot_state_area();
+	this->save_snapshot_state_to(this->memory.get_snapshot_state_area(), populate_pages);
+}
+void Machine::save_snapshot_state_to(void* map, const std::vector<std::pair<uint64_t, uint64_t>>& populate_pages) const
+{
 	SnapshotState& state = *reinterpret_cast<SnapshotState*>(map);
 	try {
 		state.magic = SnapshotState::MAGIC;
@@ -329,6 +499,45 @@ void Machine::save_snapshot_state_now(const std::vector<std::pair<uint64_t, uint
 			}
 		}
 
+		// File-backed ranges, which are re-opened by path on load.
+		// Guest writes to them are not part of the snapshot.
+		ColdStartMmapRanges* mranges = state.next<ColdStartMmapRanges>(current);
+		mranges->mmap_physical = memory.mmap_physical;
+		mranges->count = 0;
+		for (const auto& range : memory.mmap_ranges) {
+			// Ranges installed from a remote belong to the remote
+			if (range.physbase < memory.mmap_physical_begin || range.physbase >= memory.mmap_physical)
+				continue;
+			struct stat st;
+			if (range.filename.empty() || range.filename[0] != '/' || stat(range.filename.c_str(), &st) != 0) {
+				throw MachineException("Snapshot file-backed mapping has no path", range.physbase);
+			}
+			ColdStartMmapRange* cr = state.next<ColdStartMmapRange>(current);
+			cr->physbase = range.physbase;
+			cr->virtbase = range.virtbase;
+			cr->size = range.size;
+			cr->file_offset = range.file_offset;
+			cr->file_size = st.st_size;
+			cr->file_mtime = file_mtime(st);
+			cr->path_len = range.filename.size();
+			std::memcpy(state.next_bytes(current, cr->path_len), range.filename.data(), cr->path_len);
+			mranges->count++;
+		}
+		// Remote pairing, including one not yet re-established
+		ColdStartRemote* cremote = state.next<ColdStartRemote>(current);
+		cremote->physbase = m_snapshot_remote.physbase;
+		cremote->size = m_snapshot_remote.size;
+		if (this->has_remote()) {
+			if (this->is_remote_connected()) {
+				throw MachineException("Cannot save snapshot state during a remote call");
+			}
+			const auto remote_vmem = this->remote().main_memory().vmem();
+			cremote->physbase = remote_vmem.physbase;
+			cremote->size = remote_vmem.size;
+		}
+		cremote->allow_page_faults = m_remote_pfaults;
+		cremote->permanent = m_permanent_remote_connection;
+
 		// Finally, set the size
 		state.size = static_cast<uint32_t>(
 			reinterpret_cast<char*>(current) - reinterpret_cast<char*>(&state));
@@ -348,6 +557,251 @@ void Machine::save_snapshot_state_now(const std::vector<std::pair<uint64_t, uint
 	}
 }
 
+int Machine::share_main_memory()
+{
+	if (this->m_shared_memory_fd >= 0)
+		return this->m_shared_memory_fd;
+	if (!this->is_forkable() || this->is_forked() || memory.main_memory_writes) {
+		throw MachineException("Only a prepared master VM can share its memory");
+	}
+	if (this->banked_memory_pages() != 0 || this->has_remote()) {
+		throw MachineException("Shared master VM must have all its state in main memory");
+	}
+	if (!memory.owned || memory.has_snapshot_area()) {
+		throw MachineException("Master VM memory is already file-backed");
+	}
+	const size_t total = memory.size + vMemory::ColdStartStateSize();
+	const int fd = memfd_create("tinykvm-master", MFD_CLOEXEC | MFD_ALLOW_SEALING);
+	if (fd < 0) {
+		throw MachineException("Failed to create memfd for shared memory");
+	}
+	char* shared = (char*)MAP_FAILED;
+	try {
+		if (ftruncate(fd, total) < 0) {
+			throw MachineException("Failed to size memfd for shared memory", total);
+		}
+		shared = (char*)mmap(nullptr, total, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+		if (shared == MAP_FAILED) {
+			throw MachineException("Failed to map memfd for shared memory", total);
+		}
+		/* Only non-zero pages take up space in the memfd */
+		static constexpr size_t PSIZE = vMemory::PageSize();
+		for (size_t off = 0; off < memory.size; off += PSIZE) {
+			const auto* src = (const uint64_t*)&memory.ptr[off];
+			for (size_t i = 0; i < PSIZE / sizeof(uint64_t); i++) {
+				if (src[i] != 0) {
+					std::memcpy(&shared[off], src, PSIZE);
+					break;
+				}
+			}
+		}
+		this->save_snapshot_state_to(&shared[memory.size]);
+		munmap(shared, total);
+		shared = (char*)MAP_FAILED;
+
+		/* No process may change the master memory from now on */
+		if (fcntl(fd, F_ADD_SEALS, F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_WRITE | F_SEAL_SEAL) < 0) {
+			throw MachineException("Failed to seal memfd for shared memory");
+		}
+		/* Privately map the sealed pages over our own main memory.
+		   The CPU may still set accessed bits in the page tables. */
+		if (mmap(memory.ptr, memory.size, PROT_READ | PROT_WRITE,
+			MAP_PRIVATE | MAP_FIXED | MAP_NORESERVE, fd, 0) == MAP_FAILED) {
+			throw MachineException("Failed to map shared memory over main memory");
+		}
+	} catch (...) {
+		if (shared != MAP_FAILED)
+			munmap(shared, total);
+		close(fd);
+		throw;
+	}
+	this->m_shared_memory_fd = fd;
+	return fd;
+}
+
+void Machine::save_snapshot_delta(const std::string& filename,
+	const std::vector<std::pair<uint64_t, uint64_t>>& populate_pages) const
+{
+	if (!this->m_loaded_from_snapshot || this->is_forked()) {
+		throw MachineException("Delta snapshots need a VM loaded from a snapshot");
+	}
+	if (this->banked_memory_pages() != 0) {
+		throw MachineException("Delta snapshot VM must have all its state in main memory");
+	}
+	static constexpr size_t PSIZE = vMemory::PageSize();
+	const size_t state_size = vMemory::ColdStartStateSize();
+	const size_t total = memory.size + state_size;
+
+	/* Map the snapshot and deltas below this one, the same way
+	   that they were mapped when this VM was loaded. */
+	const std::string& base = m_snapshot_layers.at(0);
+	int fd = open(base.c_str(), O_RDONLY | O_CLOEXEC);
+	if (fd < 0) {
+		throw std::runtime_error("Failed to open VM snapshot file: " + base);
+	}
+	struct stat st;
+	char* lower = (char*)MAP_FAILED;
+	if (fstat(fd, &st) == 0 && st.st_size == off_t(total)) {
+		lower = (char*)mmap(nullptr, total, PROT_READ, MAP_PRIVATE | MAP_NORESERVE, fd, 0);
+	}
+	close(fd);
+	if (lower == MAP_FAILED) {
+		throw std::runtime_error("Failed to map VM snapshot file: " + base);
+	}
+	fd = -1;
+	try {
+		for (size_t i = 1; i < m_snapshot_layers.size(); i++) {
+			vMemory::overlay_snapshot_delta(lower, memory.size, m_snapshot_layers[i], PROT_READ);
+		}
+
+		/* Only pages that were made private copies of the snapshot can
+		   have been written to. Without the page map, fall back to the
+		   pages that are dirty in the page tables, plus the kernel area
+		   which is not mapped to user pages. That misses pages written
+		   by the host (eg. copy_to_guest) that the guest never wrote. */
+		std::vector<std::pair<uint64_t, uint64_t>> candidates;
+		if (!find_private_pages(memory.ptr, memory.size, candidates)) {
+			candidates.clear();
+			candidates.push_back({0, this->kernel_end_address() - memory.physbase});
+			for (const auto& [phys, size] : get_dirty_pages(memory)) {
+				if (phys >= memory.physbase && phys + size <= memory.physbase + memory.size)
+					candidates.push_back({phys - memory.physbase, size});
+			}
+			std::sort(candidates.begin(), candidates.end());
+		}
+
+		std::vector<ColdStartAccessedRange> ranges;
+		uint64_t next = 0;
+		for (const auto& [offset, size] : candidates) {
+			for (uint64_t page = std::max(offset, next); page < offset + size; page += PSIZE) {
+				if (std::memcmp(&memory.ptr[page], &lower[page], PSIZE) == 0)
+					continue;
+				if (!ranges.empty() && ranges.back().end + SNAPSHOT_DELTA_MERGE_GAP >= page)
+					ranges.back().end = page + PSIZE;
+				else
+					ranges.push_back({page, page + PSIZE});
+			}
+			next = std::max(next, offset + size);
+		}
+		munmap(lower, total);
+		lower = (char*)MAP_FAILED;
+
+		fd = open(filename.c_str(), O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+		if (fd < 0) {
+			throw std::runtime_error("Failed to create VM snapshot delta: " + filename);
+		}
+		auto write_at = [&] (const void* data, size_t len, off_t offset) {
+			if (pwrite(fd, data, len, offset) != ssize_t(len))
+				throw std::runtime_error("Failed to write VM snapshot delta: " + filename);
+		};
+		/* Zero pages are left as holes in the file */
+		auto write_pages_at = [&] (const char* data, size_t len, off_t offset) {
+			for (size_t off = 0; off < len; off += PSIZE) {
+				if (!page_is_zeroed((const uint64_t*)&data[off]))
+					write_at(&data[off], PSIZE, offset + off);
+			}
+		};
+		if (ftruncate(fd, total) < 0) {
+			throw std::runtime_error("Failed to size VM snapshot delta: " + filename);
+		}
+		for (const auto& range : ranges) {
+			write_pages_at(&memory.ptr[range.start], range.end - range.start, range.start);
+		}
+		/* Keep the user area of the state, which follows the state */
+		std::vector<char> state(state_size);
+		std::memcpy(state.data(), memory.get_snapshot_state_area(), state_size);
+		this->save_snapshot_state_to(state.data(), populate_pages);
+		write_pages_at(state.data(), state.size(), memory.size);
+
+		const SnapshotDelta header {
+			.magic = SnapshotDelta::MAGIC,
+			.count = uint32_t(ranges.size()),
+			.memory_size = memory.size,
+		};
+		write_at(&header, sizeof(header), total);
+		write_at(ranges.data(), ranges.size() * sizeof(ColdStartAccessedRange), total + sizeof(header));
+		close(fd);
+	} catch (...) {
+		if (lower != MAP_FAILED)
+			munmap(lower, total);
+		if (fd >= 0)
+			close(fd);
+		throw;
+	}
+}
+
+void vMemory::overlay_snapshot_delta(char* ptr, size_t size, const std::string& filename, int prot)
+{
+	const int fd = open(filename.c_str(), O_RDONLY | O_CLOEXEC);
+	if (fd < 0) {
+		throw std::runtime_error("Failed to open VM snapshot delta: " + filename);
+	}
+	try {
+		const size_t total = size + ColdStartStateSize();
+		SnapshotDelta header;
+		if (pread(fd, &header, sizeof(header), total) != sizeof(header)
+			|| header.magic != SnapshotDelta::MAGIC || header.memory_size != size) {
+			throw std::runtime_error("Invalid VM snapshot delta: " + filename);
+		}
+		std::vector<ColdStartAccessedRange> ranges(header.count);
+		const size_t bytes = ranges.size() * sizeof(ColdStartAccessedRange);
+		if (pread(fd, ranges.data(), bytes, total + sizeof(header)) != ssize_t(bytes)) {
+			throw std::runtime_error("Invalid VM snapshot delta: " + filename);
+		}
+		/* The newest VM state is always in the delta */
+		ranges.push_back({size, total});
+		std::vector<ColdStartAccessedRange> merged;
+		for (const auto& range : ranges) {
+			if (range.start >= range.end || range.end > total
+				|| ((range.start | range.end) & (PageSize() - 1)) != 0
+				|| (!merged.empty() && range.start < merged.back().end)) {
+				throw std::runtime_error("Invalid VM snapshot delta range: " + filename);
+			}
+			if (!merged.empty() && merged.back().end == range.start)
+				merged.back().end = range.end;
+			else
+				merged.push_back(range);
+		}
+		check_map_count(merged.size(), filename);
+		for (const auto& range : merged) {
+			if (mmap(ptr + range.start, range.end - range.start, prot,
+				MAP_PRIVATE | MAP_FIXED | MAP_NORESERVE, fd, range.start) == MAP_FAILED) {
+				throw std::runtime_error(std::string("Failed to map VM snapshot delta (")
+					+ strerror(errno) + "): " + filename);
+			}
+		}
+	} catch (...) {
+		close(fd);
+		throw;
+	}
+	close(fd);
+}
+
+void vMemory::start_snapshot_prefetch(std::vector<std::pair<uint64_t, uint64_t>> ranges)
+{
+	if (this->prefetch_thread.joinable())
+		return;
+	this->prefetch_thread = std::thread([this, ranges = std::move(ranges)] {
+		/* Populating maps the pages, unlike WILLNEED, which only reads
+		   them into the page cache. It also resolves missing pages of
+		   compressed snapshots. Batches keep stopping responsive. */
+		static constexpr uint64_t BATCH = 2UL << 20;
+		bool populate = true;
+		for (const auto& [start, end] : ranges) {
+			for (uint64_t addr = start; addr < end; addr += BATCH) {
+				if (this->prefetch_stop.load(std::memory_order_relaxed))
+					return;
+				const size_t len = std::min(end - addr, BATCH);
+				if (populate && madvise(this->ptr + addr, len, MADV_POPULATE_READ) == 0)
+					continue;
+				/* Older kernels */
+				populate = populate && errno != EINVAL;
+				madvise(this->ptr + addr, len, MADV_WILLNEED);
+			}
+		}
+	});
+}
+
 void* vMemory::get_snapshot_state_area() const
 {
 	if (!this->has_snapshot_area()) {
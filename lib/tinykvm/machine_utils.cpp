@@ -310,6 +310,8 @@ bool Machine::mmap_backed_area(
 		this->memory.mmap_ranges.emplace_back(mmap_phys_base, (char*)real_addr, virt_base, size_memory, std::move(filename));
 		// Set the bank index for the new mmap range
 		this->memory.mmap_ranges.back().bank_idx = region_idx;
+		this->memory.mmap_ranges.back().file_offset = off;
+		this->memory.index_mmap_ranges();
 		// XXX: TODO: madvise(MADV_DONTNEED) on the old pages using gather_buffers_from_range
 		// With the new physical memory, we now need to create pagetable entries
 		// we'll do it the slow way by allocating the same range and for each page redirect it to the new phys
@@ -658,6 +660,13 @@ void MachineProfiling::print(const char* user_defined) const {
 		printf("  %s: %lu samples, total = %luns, max = %luns, min = %luns, median = %luns\n",
 			locnames[i].c_str(), vec.size(), total, maxv, minv, median);
 	}
+	if (zeroed_page_hits + zeroed_page_misses > 0) {
+		printf("  Zeroed page reservoir: %lu hits, %lu misses\n",
+			zeroed_page_hits, zeroed_page_misses);
+	}
+	if (hugepage_regions_merged > 0) {
+		printf("  Hugepage merges: %lu regions\n", hugepage_regions_merged);
+	}
 }
 
 } // tinykvm
@@ -22,13 +22,16 @@ namespace tinykvm {
 static constexpr bool VERBOSE_MMAP = false;
 
 vMemory::vMemory(Machine& m, const MachineOptions& options,
-	uint64_t ph, uint64_t sf, char* p, size_t s, int fd, bool own)
+	uint64_t ph, uint64_t sf, char* p, size_t s, int fd, bool own,
+	std::shared_ptr<SnapshotPager> pgr)
 	: machine(m), physbase(ph), safebase(sf),
 	  // Over-allocate in order to avoid trouble with 2MB-aligned operations
 	  ptr(p), size(overaligned_memsize(s)),
-	  owned(own), snapshot_fd(fd),
+	  owned(own), snapshot_fd(fd), pager(std::move(pgr)),
+	  snapshot_prefetch(options.snapshot_prefetch),
 	  main_memory_writes(options.master_direct_memory_writes),
 	  split_hugepages(options.split_hugepages),
+	  cow_dirty_hugepages(options.cow_dirty_hugepages),
 	  executable_heap(options.executable_heap),
 	  mmap_backed_files(options.mmap_backed_files),
 	  banks(m, options)
@@ -55,7 +58,7 @@ vMemory::vMemory(Machine& m, const MachineOptions& options,
 	}
 }
 vMemory::vMemory(Machine& m, const MachineOptions& options, const vMemory& other)
-	: vMemory{m, options, other.physbase, other.safebase, other.ptr, other.size, -1, false}
+	: vMemory{m, options, other.physbase, other.safebase, other.ptr, other.size, -1, false, other.pager}
 {
 	this->executable_heap = other.executable_heap;
 	this->mmap_physical_begin = other.mmap_physical_begin;
@@ -65,6 +68,10 @@ vMemory::vMemory(Machine& m, const MachineOptions& options, const vMemory& other
 }
 vMemory::~vMemory()
 {
+	if (this->prefetch_thread.joinable()) {
+		this->prefetch_stop = true;
+		this->prefetch_thread.join();
+	}
 	if (this->owned) {
 		munmap(this->ptr, this->size);
 
@@ -114,6 +121,7 @@ void vMemory::install_mmap_ranges(const Machine &other)
 		new_range.bank_idx = region_idx;
 		this->mmap_ranges.push_back(new_range);
 	}
+	this->index_mmap_ranges();
 }
 void vMemory::delete_foreign_mmap_ranges()
 {
@@ -132,6 +140,7 @@ void vMemory::delete_foreign_mmap_ranges()
 			++it;
 		}
 	}
+	this->index_mmap_ranges();
 }
 void vMemory::delete_foreign_banks()
 {
@@ -150,22 +159,67 @@ bool vMemory::compare(const vMemory& other)
 	return this->ptr == other.ptr;
 }
 
-void vMemory::record_cow_leaf_user_page(uint64_t addr)
+void vMemory::record_cow_leaf_user_page(uint64_t addr, uint64_t paddr, size_t size)
 {
 	// When running forked, record page address to be restored in fork_reset.
-	// Pages are assumed to be leaf user pages.
+	// Pages are assumed to be leaf user pages, backed by a memory bank.
 	if (machine.is_forked()) {
-		auto it = std::lower_bound(cow_written_pages.begin(), cow_written_pages.end(), addr);
-		cow_written_pages.insert(it, addr);
+		auto* bank = banks.bank_at(paddr);
+		if (LIKELY(bank != nullptr)) {
+			bank->record_cow_page(paddr & ~(size - 1), addr & ~(size - 1), size);
+		} else {
+			this->cow_pages_untracked = true;
+		}
 	}
 }
 
+void vMemory::record_dirty_ring_page(uint64_t paddr)
+{
+	// Writes from the host are not seen by the KVM dirty ring.
+	auto* bank = banks.bank_at(paddr);
+	if (bank != nullptr && !this->dirty_ring_overflow) {
+		const uint64_t page = (paddr - bank->addr) / vMemory::PageSize();
+		dirty_ring_pages.push_back(uint64_t(bank->idx) << 32 | page);
+		// Too many host writes, just restore every CoW page instead
+		this->dirty_ring_overflow = dirty_ring_pages.size() > banks.max_pages();
+	}
+}
+void vMemory::record_dirty_ring_pages(const vCPU& cpu)
+{
+	if (this->smp_guards_enabled) {
+		std::lock_guard<std::mutex> lock(this->mtx_smp);
+		this->dirty_ring_harvested += cpu.harvest_dirty_ring(dirty_ring_pages);
+	} else {
+		this->dirty_ring_harvested += cpu.harvest_dirty_ring(dirty_ring_pages);
+	}
+	// The ring re-arms harvested pages, so the same pages may
+	// be seen many times. Beyond the working memory, just restore
+	// every CoW page instead.
+	if (this->dirty_ring_overflow || dirty_ring_pages.size() > banks.max_pages()) {
+		this->dirty_ring_overflow = true;
+		this->dirty_ring_pages.clear();
+	}
+}
+
+void vMemory::reset_banks(const MachineOptions& options)
+{
+	banks.reset(options);
+	this->cow_pages_untracked = false;
+	this->dirty_ring_pages.clear();
+	this->dirty_ring_overflow = false;
+}
+
 bool vMemory::fork_reset(const Machine& main_vm, const MachineOptions& options)
 {
-	if (options.reset_keep_all_work_memory) {
+	this->tlb.invalidate();
+	if (this->dirty_ring_entries != 0) {
+		// Pages dirtied by the guest since the last reset
+		this->record_dirty_ring_pages(machine.cpu());
+	}
+	if (options.reset_keep_all_work_memory && !this->cow_pages_untracked) {
 		// With this method, instead of resetting the memory banks,
 		// and the pagetables, which requires an expensive mov cr3,
-		// we will iterate the pagetables and copy non-CoW pages
+		// we will copy every CoW-written page recorded in the banks
 		// from the master VM to this forked VM. This is a gamble
 		// that it's cheaper to copy than the TLB flushes that happen
 		// from the mov cr3.
@@ -179,27 +233,43 @@ bool vMemory::fork_reset(const Machine& main_vm, const MachineOptions& options)
 				vMemory::PageSize();
 			if (used > uint64_t(options.reset_free_work_mem)) {
 				//fprintf(stderr, "Freeing %zu bytes of work memory\n", used);
-				this->banks.reset(options);
-				cow_written_pages.clear();
+				this->reset_banks(options);
 				return true;
 			}
 		}
 		// Restore the original memory from the master VM.
 		try {
-		for (const uint64_t addr : cow_written_pages) {
-			tinykvm::page_at(*this, addr, [&](uint64_t addr, uint64_t& entry, uint64_t page_size) {
-				static constexpr uint64_t PDE64_ADDR_MASK = ~0x8000000000000FFF;
-				const uint64_t bank_addr = entry & PDE64_ADDR_MASK;
-				//fprintf(stderr, "Copying virtual page %016lx from physical %016lx with size %lu\n",
-				//	addr, bank_addr, page_size);
-
+		const auto& main_memory = main_vm.main_memory();
+		// With the dirty ring, only pages dirtied since the last reset
+		// are restored. SMP vCPUs have their own rings, so fall back to
+		// restoring every CoW page when SMP has been used.
+		if (this->dirty_ring_entries != 0 && !this->dirty_ring_overflow && !this->smp_guards_enabled) {
+			MemoryBank* bank = nullptr;
+			for (const uint64_t entry : dirty_ring_pages) {
+				const uint32_t slot = entry >> 32;
+				const uint32_t page = entry & 0xFFFFFFFF;
+				if (bank == nullptr || bank->idx != slot) {
+					bank = banks.bank_by_slot(slot);
+					if (bank == nullptr)
+						continue;
+				}
+				if (bank->has_cow_page(page)) {
+					page_duplicate((uint64_t*)&bank->mem[page * PAGE_SIZE],
+						(const uint64_t*)main_memory.safely_at(bank->cow_vaddr[page], PAGE_SIZE));
+				}
+			}
+			this->dirty_ring_pages.clear();
+			return false;
+		}
+		this->dirty_ring_pages.clear();
+		this->dirty_ring_overflow = false;
+		for (auto& bank : banks) {
+			bank.foreach_cow_page([&](uint64_t addr, char* our_page) {
 				// This is a writable page, we will copy it using the "real"
 				// address from the master VM.
-				auto* our_page = this->safely_at(bank_addr, page_size);
-				// Find the page in the main VM
 				page_duplicate((uint64_t*)our_page,
-					(const uint64_t*)main_vm.main_memory().safely_at(addr, page_size));
-			}, false);
+					(const uint64_t*)main_memory.safely_at(addr, PAGE_SIZE));
+			});
 		}
 		return false;
 		} catch (const std::exception& e) {
@@ -209,18 +279,18 @@ bool vMemory::fork_reset(const Machine& main_vm, const MachineOptions& options)
 		/// Fallthrough to reset the memory banks
 	}
 	// Reset the memory banks (also fallback if the above fails)
-	banks.reset(options);
-	cow_written_pages.clear();
+	this->reset_banks(options);
 	return true;
 }
 void vMemory::fork_reset(const vMemory& other, const MachineOptions& options)
 {
+	this->tlb.invalidate();
 	this->physbase = other.physbase;
 	this->safebase = other.safebase;
 	this->owned    = false;
 	this->ptr  = other.ptr;
 	this->size = other.size;
-	banks.reset(options);
+	this->reset_banks(options);
 }
 bool vMemory::is_forkable_master() const noexcept
 {
@@ -231,38 +301,27 @@ char* vMemory::at(uint64_t addr, size_t asize)
 {
 	if (within(addr, asize))
 		return &ptr[addr - physbase];
-	for (auto& bank : banks) {
-		if (bank.within(addr, asize)) {
-			return bank.at(addr);
-		}
-	}
+	if (auto* bank = banks.find(addr, asize))
+		return bank->at(addr);
 	memory_exception("Memory::at() invalid region", addr, asize);
 }
 const char* vMemory::at(uint64_t addr, size_t asize) const
 {
 	if (within(addr, asize))
 		return &ptr[addr - physbase];
-	for (auto& bank : banks) {
-		if (bank.within(addr, asize)) {
-			return bank.at(addr);
-		}
-	}
+	if (auto* bank = banks.find(addr, asize))
+		return bank->at(addr);
 	memory_exception("Memory::at() invalid region", addr, asize);
 }
 uint64_t* vMemory::page_at(uint64_t addr) const
 {
 	if (within(addr, PAGE_SIZE))
 		return (uint64_t *)&ptr[addr - physbase];
-	for (const auto& bank : banks) {
-		if (bank.within(addr, PAGE_SIZE))
-			return (uint64_t *)bank.at(addr);
-	}
+	if (auto* bank = banks.find(addr, PAGE_SIZE))
+		return (uint64_t *)bank->at(addr);
 	/* mmap ranges */
-	for (const auto& vmem : mmap_ranges) {
-		if (addr >= vmem.physbase && addr < vmem.physbase + vmem.size) {
-			return (uint64_t *)(vmem.ptr + (addr - vmem.physbase));
-		}
-	}
+	if (auto* vmem = this->mmap_range_at(addr))
+		return (uint64_t *)(vmem->ptr + (addr - vmem->physbase));
 	/* Remote machine always last resort */
 	if (machine.has_remote()) {
 		return machine.remote().main_memory().page_at(addr);
@@ -272,11 +331,8 @@ uint64_t* vMemory::page_at(uint64_t addr) const
 char* vMemory::safely_at(uint64_t addr, size_t asize)
 {
 	/* XXX: Security checks */
-	for (auto& bank : banks) {
-		if (bank.within(addr, asize)) {
-			return bank.at(addr);
-		}
-	}
+	if (auto* bank = banks.find(addr, asize))
+		return bank->at(addr);
 
 	if (safely_within(addr, asize))
 		return &ptr[addr - physbase];
@@ -293,11 +349,8 @@ const char* vMemory::safely_at(uint64_t addr, size_t asize) const
 	if (safely_within(addr, asize))
 		return &ptr[addr - physbase];
 	/* XXX: Security checks */
-	for (auto& bank : banks) {
-		if (bank.within(addr, asize)) {
-			return bank.at(addr);
-		}
-	}
+	if (auto* bank = banks.find(addr, asize))
+		return bank->at(addr);
 	/* Remote machine always last resort */
 	if (machine.has_remote()) {
 		return machine.remote().main_memory().safely_at(addr, asize);
@@ -308,11 +361,8 @@ std::string_view vMemory::view(uint64_t addr, size_t asize) const {
 	if (safely_within(addr, asize))
 		return {&ptr[addr - physbase], asize};
 	/* XXX: Security checks */
-	for (const auto& bank : banks) {
-		if (bank.within(addr, asize)) {
-			return bank.at(addr);
-		}
-	}
+	if (auto* bank = banks.find(addr, asize))
+		return {bank->at(addr), asize};
 	/* Remote machine always last resort */
 	if (machine.has_remote())
 	{
@@ -321,6 +371,36 @@ std::string_view vMemory::view(uint64_t addr, size_t asize) const {
 	memory_exception("vMemory::view failed", addr, asize);
 }
 
+const VirtualMem* vMemory::mmap_range_at(uint64_t addr) const noexcept
+{
+	const uint16_t value = mmap_frames.lookup(addr);
+	if (LIKELY(value != FrameTable::AMBIGUOUS)) {
+		if (value != FrameTable::NONE) {
+			const auto& vmem = mmap_ranges[value - 1];
+			if (addr >= vmem.physbase && addr < vmem.physbase + vmem.size)
+				return &vmem;
+		}
+		return nullptr;
+	}
+	for (const auto& vmem : mmap_ranges) {
+		if (addr >= vmem.physbase && addr < vmem.physbase + vmem.size) {
+			return &vmem;
+		}
+	}
+	return nullptr;
+}
+void vMemory::index_mmap_ranges()
+{
+	this->tlb.invalidate();
+	uint64_t base = UINT64_MAX;
+	for (const auto& vmem : mmap_ranges)
+		base = std::min(base, vmem.physbase);
+	this->mmap_frames.clear(base & ~((1ULL << FrameTable::FRAME_SHIFT) - 1));
+	for (size_t i = 0; i < mmap_ranges.size(); i++) {
+		mmap_frames.insert(mmap_ranges[i].physbase, mmap_ranges[i].size, i + 1);
+	}
+}
+
 vMemory::AllocationResult vMemory::allocate_mapped_memory(
 	const MachineOptions& options, size_t size)
 {
@@ -379,14 +459,11 @@ vMemory::AllocationResult vMemory::allocate_mapped_memory(
 	if (advice != 0x0) {
 		madvise(ptr, size, advice);
 	}
-	return AllocationResult{ptr, size, -1};
+	return AllocationResult{ptr, size, -1, nullptr};
 }
 vMemory::AllocationResult
 	vMemory::allocate_filebacked_memory(const MachineOptions& options, size_t size)
 {
-	if (options.mmap_backed_files) {
-		throw std::runtime_error("Incompatible options: mmap_backed_files and allocate_file_backed_memory()");
-	}
 	if (size < 0x1000L) {
 		memory_exception("Not enough guest memory", 0, size);
 	}
@@ -422,10 +499,22 @@ vMemory::AllocationResult
 	char* ptr = (char*)MAP_FAILED;
 	// If the file is not the correct size, resize it
 	if (!already_right_size) {
+		if (st.st_size != 0 && is_compressed_snapshot(fd)) {
+			// Compressed snapshots are paged in on demand
+			if (!options.snapshot_deltas.empty()) {
+				close(fd);
+				throw std::runtime_error("VM snapshot deltas need an uncompressed snapshot file: " + filename);
+			}
+			return allocate_compressed_memory(options, size - ColdStartStateSize(), fd);
+		}
 		if (st.st_size != 0) {
 			close(fd);
 			throw std::runtime_error("VM snapshot file has incorrect size: " + filename);
 		}
+		if (!options.snapshot_deltas.empty()) {
+			close(fd);
+			throw std::runtime_error("VM snapshot deltas need an existing snapshot file: " + filename);
+		}
 		// Create the file with the correct size
 		if (ftruncate(fd, size) != 0) {
 			close(fd);
@@ -445,7 +534,16 @@ vMemory::AllocationResult
 	if (ptr == MAP_FAILED) {
 		memory_exception("Failed to mmap VM snapshot file", 0, size);
 	}
-	return AllocationResult{ptr, size - ColdStartStateSize(), fd};
+	// Stack the delta snapshots on top, each one overriding the last
+	for (const auto& delta : options.snapshot_deltas) {
+		try {
+			overlay_snapshot_delta(ptr, size - ColdStartStateSize(), delta, PROT_READ | PROT_WRITE);
+		} catch (...) {
+			munmap(ptr, size);
+			throw;
+		}
+	}
+	return AllocationResult{ptr, size - ColdStartStateSize(), fd, nullptr};
 }
 
 vMemory vMemory::New(Machine& m, const MachineOptions& options,
@@ -457,11 +555,11 @@ vMemory vMemory::New(Machine& m, const MachineOptions& options,
 	size = vMemory::overaligned_memsize(size);
 	// Use file-backed memory if requested
 	if (!options.snapshot_file.empty()) {
-		const auto [res_ptr, res_size, fd] = allocate_filebacked_memory(options, size);
-		return vMemory(m, options, phys, safe, res_ptr, res_size, fd);
+		auto [res_ptr, res_size, fd, pager] = allocate_filebacked_memory(options, size);
+		return vMemory(m, options, phys, safe, res_ptr, res_size, fd, true, std::move(pager));
 	}
 	// Normal 2MB main memory allocation
-	const auto [res_ptr, res_size, fd] = allocate_mapped_memory(options, size);
+	const auto [res_ptr, res_size, fd, pager] = allocate_mapped_memory(options, size);
 	return vMemory(m, options, phys, safe, res_ptr, res_size, -1);
 }
 
@@ -472,10 +570,33 @@ VirtualMem vMemory::vmem() const
 
 MemoryBank::Page vMemory::new_page()
 {
+	/* New pages are (mostly) for changing the page tables */
+	this->tlb.invalidate();
 	return banks.get_available_bank(1u).get_next_page(1u);
 }
+MemoryBank::Page vMemory::new_zeroed_page()
+{
+	MemoryBank::Page page;
+	if (banks.has_zeroed_page_reservoir()) {
+		auto* prof = machine.profiling();
+		if (banks.take_zeroed_page(page)) {
+			this->tlb.invalidate();
+			if (prof) prof->zeroed_page_hits++;
+			return page;
+		}
+		if (prof) prof->zeroed_page_misses++;
+	}
+	page = this->new_page();
+	/* Zero the page, if it's dirty */
+	if (page.dirty) {
+		tinykvm::page_memzero(page.pmem);
+		page.dirty = false;
+	}
+	return page;
+}
 MemoryBank::Page vMemory::new_hugepage()
 {
+	this->tlb.invalidate();
 	return banks.get_available_bank(512u).get_next_page(512u);
 }
 
@@ -483,17 +604,24 @@ size_t vMemory::merge_leaf_pages_into_hugepages()
 {
 	return paging_merge_leaf_pages_into_hugepages(*this);
 }
+size_t vMemory::merge_private_pages_into_hugepages()
+{
+	const size_t regions = paging_merge_private_pages_into_hugepages(*this);
+	this->merged_hugepage_regions += regions;
+	return regions;
+}
 
-char* vMemory::get_writable_page(uint64_t addr, uint64_t flags, bool zeroes, bool dirty)
+char* vMemory::get_writable_page(uint64_t addr, uint64_t flags, bool zeroes, bool dirty, bool cached)
 {
 //	printf("*** Need a writable page at 0x%lX  (%s)\n", addr, (zeroes) ? "zeroed" : "copy");
 	if (machine.has_remote() && machine.is_foreign_address(addr)) {
 		// When connected to a remote VM, we can access the remote kernel memory
-		return machine.remote().main_memory().get_writable_page(addr, flags, zeroes, dirty);
+		return machine.remote().main_memory().get_writable_page(addr, flags, zeroes, dirty, false);
 	}
 
 	WritablePageOptions zero_opts;
 	zero_opts.zeroes = zeroes;
+	zero_opts.cached = cached;
 	auto writable_page = writable_page_at(*this, addr, flags, zero_opts);
 	if (dirty) {
 		writable_page.set_dirty();
@@ -501,29 +629,29 @@ char* vMemory::get_writable_page(uint64_t addr, uint64_t flags, bool zeroes, boo
 	return writable_page.page;
 }
 
-char* vMemory::get_kernelpage_at(uint64_t addr) const
+char* vMemory::get_kernelpage_at(uint64_t addr, bool cached) const
 {
 	if (machine.has_remote() && machine.is_foreign_address(addr)) {
 		// When connected to a remote VM, we can access the remote kernel memory
-		return machine.remote().main_memory().get_kernelpage_at(addr);
+		return machine.remote().main_memory().get_kernelpage_at(addr, false);
 	}
 #ifdef TINYKVM_ARCH_AMD64
 	constexpr uint64_t flags = PDE64_PRESENT;
-	return readable_page_at(*this, addr, flags);
+	return readable_page_at(*this, addr, flags, cached);
 #else
 #error "Implement me!"
 #endif
 }
 
-char* vMemory::get_userpage_at(uint64_t addr) const
+char* vMemory::get_userpage_at(uint64_t addr, bool cached) const
 {
 	if (machine.has_remote() && machine.is_foreign_address(addr)) {
 		// When connected to a remote VM, we can access the remote kernel memory
-		return machine.remote().main_memory().get_userpage_at(addr);
+		return machine.remote().main_memory().get_userpage_at(addr, false);
 	}
 #ifdef TINYKVM_ARCH_AMD64
 	constexpr uint64_t flags = PDE64_PRESENT | PDE64_USER;
-	return readable_page_at(*this, addr, flags);
+	return readable_page_at(*this, addr, flags, cached);
 #else
 #error "Implement me!"
 #endif
@@ -533,6 +661,24 @@ std::vector<std::pair<uint64_t, uint64_t>> Machine::get_accessed_pages() const
 {
 	return tinykvm::get_accessed_pages(this->main_memory());
 }
+void Machine::set_warm_set(const std::vector<std::pair<uint64_t, uint64_t>>& pages)
+{
+	// Only copy-on-write user pages will page fault in forks
+	this->m_warm_set = tinykvm::get_cow_user_pages(this->memory, pages);
+}
+void Machine::prefault_warm_set(const Machine& other)
+{
+	WritablePageOptions zero_opts;
+	zero_opts.zeroes = false;
+	for (const uint64_t addr : other.m_warm_set) {
+		try {
+			(void)writable_page_at(this->memory, addr, PDE64_USER | PDE64_RW, zero_opts);
+		} catch (const MemoryException&) {
+			// Out of working memory, leave the rest to page faults
+			break;
+		}
+	}
+}
 size_t Machine::banked_memory_pages() const noexcept
 {
 	size_t count = 0;
@@ -2,13 +2,52 @@
 #include "common.hpp"
 #include "memory_bank.hpp"
 #include "virtual_mem.hpp"
+#include <array>
+#include <atomic>
 #include <cstddef>
+#include <memory>
 #include <mutex>
 #include <string_view>
+#include <thread>
 
 namespace tinykvm {
 struct Machine;
 struct MemoryBanks;
+struct vCPU;
+
+/* A small direct-mapped cache of guest virtual pages to host pages,
+   used by readable_page_at() and writable_page_at(). Each entry also
+   remembers the leaf page table entry, and is only used while the leaf
+   entry is unchanged. Anything that allocates pages or restructures the
+   page tables must invalidate the whole cache. Only the VM that owns the
+   memory uses the cache: A remote VM is shared by many forks at once. */
+struct GuestTLB {
+	static constexpr size_t ENTRIES = 64;
+	struct Entry {
+		uint64_t  vaddr = 0;
+		uint64_t* entry = nullptr; /* Leaf page table entry */
+		uint64_t  value = 0;       /* Leaf entry when cached */
+		uint64_t  flags = 0;       /* Flags verified on every level */
+		char*     page = nullptr;  /* Host memory for vaddr */
+		uint64_t  size = 0;        /* Leaf page size */
+		uint64_t  generation = 0;
+		bool      writable = false; /* From writable_page_at() */
+	};
+
+	Entry* find(uint64_t vaddr) noexcept {
+		auto& e = slot(vaddr);
+		return (e.generation == current() && e.vaddr == vaddr) ? &e : nullptr;
+	}
+	Entry& slot(uint64_t vaddr) noexcept {
+		return entries[(vaddr >> 12) % ENTRIES];
+	}
+	uint64_t current() const noexcept { return generation.load(std::memory_order_relaxed); }
+	/* Other VMs may allocate pages in a remote VM concurrently */
+	void invalidate() noexcept { generation.fetch_add(1, std::memory_order_relaxed); }
+
+	std::array<Entry, ENTRIES> entries {};
+	std::atomic<uint64_t> generation = 1;
+};
 
 struct vMemory {
 	static constexpr uint64_t MMAP_PHYS_BASE = 0x4000000000;
@@ -17,7 +56,6 @@ struct vMemory {
 	}
 
 	Machine& machine;
-	std::vector<uint64_t> cow_written_pages{};
 	uint64_t physbase;
 	uint64_t safebase;
 	uint64_t page_tables;
@@ -29,6 +67,12 @@ struct vMemory {
 	size_t size;
 	bool   owned = true;
 	int    snapshot_fd = -1;
+	/* Pages in main memory from a compressed snapshot on demand */
+	std::shared_ptr<struct SnapshotPager> pager = nullptr;
+	/* Populates recorded snapshot accesses after loading */
+	bool   snapshot_prefetch = true;
+	std::thread prefetch_thread;
+	std::atomic<bool> prefetch_stop = false;
 	/* Remote end pointer for this memory */
 	uint64_t remote_end = 0;
 	bool     remote_must_update_gigapages = true;
@@ -37,20 +81,34 @@ struct vMemory {
 	bool   main_memory_writes = false;
 	/* Split into small pages (4K) when reaching a leaf hugepage. */
 	bool   split_hugepages = true;
+	/* Duplicate 2MB pages dirtied in the master whole, even when splitting. */
+	bool   cow_dirty_hugepages = false;
 	/* Executable heap */
 	bool   executable_heap = false;
 	/* Enable file-backed memory mappings for large files */
 	bool   mmap_backed_files = true;
+	/* A CoW-written page could not be recorded in a bank, so the
+	   next fork_reset must fall back to resetting the banks. */
+	bool   cow_pages_untracked = false;
+	/* KVM dirty ring (when enabled): bank pages dirtied since the
+	   last fork_reset, encoded as (slot << 32) | page index. */
+	uint32_t dirty_ring_entries = 0;
+	bool     dirty_ring_overflow = false;
+	std::vector<uint64_t> dirty_ring_pages;
+	size_t   dirty_ring_harvested = 0;
 	/* Dynamic page memory */
 	MemoryBanks banks; // fault-in memory banks
 	/* mmap-ranges */
 	std::vector<VirtualMem> mmap_ranges;
+	FrameTable mmap_frames; // 2MB frames to mmap_ranges index
 	std::vector<unsigned> foreign_banks;
 	uint64_t mmap_physical_begin = MMAP_PHYS_BASE;
 	uint64_t mmap_physical = MMAP_PHYS_BASE;
 	/* SMP mutex */
 	std::mutex mtx_smp;
 	bool smp_guards_enabled = false;
+	/* Cached guest page translations for host accesses */
+	mutable GuestTLB tlb;
 
 	/* Unsafe */
 	bool within(uint64_t addr, size_t asize) const noexcept {
@@ -66,11 +124,17 @@ struct vMemory {
 	const char* safely_at(uint64_t addr, size_t asize) const;
 	char* safely_at(uint64_t addr, size_t asize);
 	std::string_view view(uint64_t addr, size_t asize) const;
+	const VirtualMem* mmap_range_at(uint64_t addr) const noexcept;
+	/* Call after changing mmap_ranges: Rebuilds mmap_frames
+	   and drops all cached guest page translations. */
+	void index_mmap_ranges();
 
-	char *get_userpage_at(uint64_t addr) const;
-	char *get_kernelpage_at(uint64_t addr) const;
-	char *get_writable_page(uint64_t addr, uint64_t flags, bool zeroes, bool dirty);
+	/* The translation cache is not used when accessed by another VM */
+	char *get_userpage_at(uint64_t addr, bool cached = true) const;
+	char *get_kernelpage_at(uint64_t addr, bool cached = true) const;
+	char *get_writable_page(uint64_t addr, uint64_t flags, bool zeroes, bool dirty, bool cached = true);
 	MemoryBank::Page new_page();
+	MemoryBank::Page new_zeroed_page();
 	MemoryBank::Page new_hugepage();
 	MemoryBank::Page allocate_unmapped_kernelpage();
 
@@ -86,11 +150,20 @@ struct vMemory {
 	/* Merge leaf pages back into hugepages where possible, ignoring
 	   access bits. This is done to reduce page walking overhead. */
 	size_t merge_leaf_pages_into_hugepages();
+	/* Merge 2MB regions where every leaf page has been privatized
+	   into 2MB working memory pages. Used by long-lived forks. */
+	size_t merge_private_pages_into_hugepages();
+	uint32_t resets_since_hugepage_merge = 0;
+	size_t   merged_hugepage_regions = 0;
 
 	VirtualMem vmem() const;
 
 	[[noreturn]] static void memory_exception(const char*, uint64_t, uint64_t, bool oom = false);
-	void record_cow_leaf_user_page(uint64_t addr);
+	void record_cow_leaf_user_page(uint64_t addr, uint64_t paddr, size_t size);
+	void record_dirty_ring_page(uint64_t paddr);
+	void record_dirty_ring_pages(const vCPU&);
+	/* Release the memory banks and everything tracked in them */
+	void reset_banks(const MachineOptions&);
 	bool fork_reset(const Machine&, const MachineOptions&); // Returns true if a full reset was done
 	void fork_reset(const vMemory& other, const MachineOptions&);
 	static vMemory New(Machine&, const MachineOptions&, uint64_t phys, uint64_t safe, size_t size);
@@ -101,13 +174,18 @@ struct vMemory {
 	uint64_t expectedUsermodeFlags() const noexcept;
 
 	/* Create new identity-mapped memory regions */
-	vMemory(Machine&, const MachineOptions&, uint64_t, uint64_t, char*, size_t, int fd, bool own = true);
+	vMemory(Machine&, const MachineOptions&, uint64_t, uint64_t, char*, size_t, int fd, bool own = true,
+		std::shared_ptr<struct SnapshotPager> pager = nullptr);
 	unsigned allocate_region_idx();
 	void install_mmap_ranges(const Machine& other);
 	void delete_foreign_mmap_ranges();
 	void delete_foreign_banks();
 	/* Loan memory from another machine */
 	vMemory(Machine&, const MachineOptions&, const vMemory& other);
+	/* Throws when a page of a compressed snapshot could not be read */
+	void check_snapshot_pager() const {
+		if (UNLIKELY(pager != nullptr)) snapshot_pager_failed();
+	}
 	~vMemory();
 
 	static uint64_t overaligned_memsize(uint64_t size) {
@@ -125,10 +203,18 @@ struct vMemory {
 	bool has_snapshot_area() const noexcept {
 		return snapshot_fd != -1;
 	}
+	/* Privately map the pages of a delta snapshot over a snapshot
+	   mapping, where size is the main memory part of the mapping. */
+	static void overlay_snapshot_delta(char* ptr, size_t size, const std::string& filename, int prot);
+	/* Populate the given main memory ranges on a background thread */
+	void start_snapshot_prefetch(std::vector<std::pair<uint64_t, uint64_t>> ranges);
 private:
-	using AllocationResult = std::tuple<char*, size_t, int>;
+	using AllocationResult = std::tuple<char*, size_t, int, std::shared_ptr<struct SnapshotPager>>;
 	static AllocationResult allocate_mapped_memory(const MachineOptions&, size_t size);
 	static AllocationResult allocate_filebacked_memory(const MachineOptions&, size_t size);
+	static AllocationResult allocate_compressed_memory(const MachineOptions&, size_t size, int fd);
+	static bool is_compressed_snapshot(int fd);
+	void snapshot_pager_failed() const;
 	std::vector<unsigned> m_bank_idx_free_list;
 };
 
@@ -2,15 +2,202 @@
 
 #include "common.hpp"
 #include "machine.hpp"
+#include "page_streaming.hpp"
 #include "virtual_mem.hpp"
+#include <algorithm>
+#include <atomic>
 #include <cassert>
+#include <condition_variable>
 #include <cstring>
+#include <deque>
 #include <malloc.h>
+#include <mutex>
 #include <sys/mman.h>
+#include <sys/syscall.h>
+#include <thread>
+#include <unistd.h>
+#include <x86intrin.h>
 
 namespace tinykvm {
 static constexpr bool VERBOSE_MEMORY_BANK = false;
 
+/* A process-wide pool of bank-sized memory chunks, with one lock-free
+   free list per NUMA node. Chunks are given back with their pages
+   already released (MADV_DONTNEED), so a borrowed chunk is zeroed and
+   will be faulted in on the node of the thread that touches it. */
+struct MemoryBankPool {
+	static constexpr unsigned MAX_NODES = 8;
+	static constexpr unsigned MAX_CHUNKS = 1u << 16;
+	static constexpr size_t CHUNK_SIZE = MemoryBank::N_PAGES * 4096UL;
+
+	/* Returns a chunk index, or -1 if the pool is exhausted */
+	int32_t borrow()
+	{
+		const unsigned node = current_node();
+		for (unsigned i = 0; i < MAX_NODES; i++) {
+			const int32_t idx = pop(m_free[(node + i) % MAX_NODES]);
+			if (idx >= 0)
+				return idx;
+		}
+		/* Create a new chunk */
+		const uint32_t idx = m_count.fetch_add(1, std::memory_order_relaxed);
+		if (idx >= MAX_CHUNKS) {
+			m_count.fetch_sub(1, std::memory_order_relaxed);
+			return -1;
+		}
+		char* mem = (char*) mmap(NULL, CHUNK_SIZE, PROT_READ | PROT_WRITE,
+			MAP_ANONYMOUS | MAP_PRIVATE | MAP_NORESERVE, -1, 0);
+		if (mem == MAP_FAILED) {
+			/* The index is lost, but the pool stays consistent */
+			return -1;
+		}
+		m_chunks[idx] = mem;
+		return idx;
+	}
+	void give_back(int32_t idx)
+	{
+		push(m_free[current_node() % MAX_NODES], idx);
+	}
+	char* chunk(int32_t idx) const noexcept { return m_chunks[idx]; }
+
+	static MemoryBankPool& get() {
+		static MemoryBankPool pool;
+		return pool;
+	}
+
+private:
+	/* The list heads are (ABA tag << 32) | (index + 1), with 0 as empty */
+	int32_t pop(std::atomic<uint64_t>& head)
+	{
+		uint64_t old = head.load(std::memory_order_acquire);
+		while (true) {
+			const uint32_t idx1 = old & 0xFFFFFFFF;
+			if (idx1 == 0)
+				return -1;
+			const uint64_t next = m_next[idx1 - 1].load(std::memory_order_relaxed);
+			const uint64_t desired = (((old >> 32) + 1) << 32) | next;
+			if (head.compare_exchange_weak(old, desired,
+					std::memory_order_acq_rel, std::memory_order_acquire))
+				return idx1 - 1;
+		}
+	}
+	void push(std::atomic<uint64_t>& head, int32_t idx)
+	{
+		uint64_t old = head.load(std::memory_order_relaxed);
+		uint64_t desired;
+		do {
+			m_next[idx].store(old & 0xFFFFFFFF, std::memory_order_relaxed);
+			desired = (((old >> 32) + 1) << 32) | uint32_t(idx + 1);
+		} while (!head.compare_exchange_weak(old, desired,
+			std::memory_order_release, std::memory_order_relaxed));
+	}
+	static unsigned current_node()
+	{
+		unsigned cpu = 0, node = 0;
+		if (syscall(SYS_getcpu, &cpu, &node, nullptr) < 0)
+			return 0;
+		return node;
+	}
+
+	std::array<std::atomic<uint64_t>, MAX_NODES> m_free {};
+	std::atomic<uint32_t> m_count = 0;
+	std::array<char*, MAX_CHUNKS> m_chunks {};
+	std::array<std::atomic<uint32_t>, MAX_CHUNKS> m_next {};
+};
+
+/* Zero a page with non-temporal stores. SSE2 is always available on
+   x86-64, and this file is not built with AVX enabled. Needs a store
+   fence before the page is handed to another thread or the guest. */
+static void page_stream_memzero(uint64_t* dest)
+{
+	const auto iz = _mm_setzero_si128();
+	for (size_t i = 0; i < 4096 / sizeof(__m128i); i++) {
+		_mm_stream_si128((__m128i *)&dest[2 * i], iz);
+	}
+}
+
+/* Reservoir pages of one VM. The pages are zeroed in order, and each
+   page can be taken by the VM as soon as it is counted in ready. */
+struct ZeroedPageJob {
+	enum : int { QUEUED, RUNNING, DONE };
+	std::vector<MemoryBank::Page> pages;
+	std::atomic<uint32_t> ready = 0;
+	std::atomic<int>  state = QUEUED;
+	std::atomic<bool> cancelled = false;
+};
+
+/* A background thread that zeroes reservoir pages, so that forking
+   and resetting only have to set the pages aside. */
+struct PageZeroer {
+	void submit(std::shared_ptr<ZeroedPageJob> job)
+	{
+		std::unique_lock<std::mutex> lock(m_mtx);
+		m_jobs.push_back(std::move(job));
+		if (!m_thread.joinable()) {
+			m_thread = std::thread(&PageZeroer::worker, this);
+		}
+		lock.unlock();
+		m_cond.notify_one();
+	}
+	/* After this returns, the pages are no longer written to */
+	static void cancel(ZeroedPageJob& job)
+	{
+		int expected = ZeroedPageJob::QUEUED;
+		if (job.state.compare_exchange_strong(expected, ZeroedPageJob::DONE))
+			return;
+		job.cancelled.store(true, std::memory_order_relaxed);
+		while (job.state.load(std::memory_order_acquire) != ZeroedPageJob::DONE)
+			std::this_thread::yield();
+	}
+
+	static PageZeroer& get() {
+		static PageZeroer zeroer;
+		return zeroer;
+	}
+	~PageZeroer() {
+		{
+			std::lock_guard<std::mutex> lock(m_mtx);
+			m_stop = true;
+		}
+		m_cond.notify_one();
+		if (m_thread.joinable())
+			m_thread.join();
+	}
+
+private:
+	void worker()
+	{
+		std::unique_lock<std::mutex> lock(m_mtx);
+		while (true) {
+			m_cond.wait(lock, [this] { return m_stop || !m_jobs.empty(); });
+			if (m_stop)
+				return;
+			auto job = std::move(m_jobs.front());
+			m_jobs.pop_front();
+			lock.unlock();
+			int expected = ZeroedPageJob::QUEUED;
+			if (job->state.compare_exchange_strong(expected, ZeroedPageJob::RUNNING)) {
+				for (size_t i = 0; i < job->pages.size(); i++) {
+					if (job->cancelled.load(std::memory_order_relaxed))
+						break;
+					/* Also faults in never-used pages, outside of the guest fault path */
+					page_stream_memzero(job->pages[i].pmem);
+					_mm_sfence();
+					job->ready.store(i + 1, std::memory_order_release);
+				}
+				job->state.store(ZeroedPageJob::DONE, std::memory_order_release);
+			}
+			lock.lock();
+		}
+	}
+
+	std::mutex m_mtx;
+	std::condition_variable m_cond;
+	std::deque<std::shared_ptr<ZeroedPageJob>> m_jobs;
+	bool m_stop = false;
+	std::thread m_thread;
+};
+
 MemoryBanks::MemoryBanks(Machine& machine, const MachineOptions& options)
 	: m_machine { machine },
 	  m_arena_begin { ARENA_BASE_ADDRESS },
@@ -21,8 +208,17 @@ MemoryBanks::MemoryBanks(Machine& machine, const MachineOptions& options)
 		this->m_arena_begin += 0x800000000;
 		this->m_arena_next = m_arena_begin;
 	}
+	this->m_frames.clear(m_arena_begin);
 	this->set_max_pages(options.max_cow_mem / vMemory::PageSize(),
 		options.hugepages_arena_size / vMemory::PageSize());
+	this->m_use_pool = options.memory_bank_pool;
+	this->m_hugetlb_banks = options.hugepage_working_memory;
+	this->m_zeroed_reservoir = options.zeroed_page_reservoir;
+	m_zeroed_pages.reserve(m_zeroed_reservoir);
+}
+MemoryBanks::~MemoryBanks()
+{
+	this->cancel_zeroed_pages();
 }
 void MemoryBanks::init_from(const MemoryBanks& other)
 {
@@ -33,6 +229,7 @@ void MemoryBanks::init_from(const MemoryBanks& other)
 		throw MemoryException("Cannot init_from() when banks are already allocated (arena_begin will be wrong)",
 			this->m_arena_begin, m_mem[0].addr);
 	}
+	this->m_frames.clear(m_arena_begin);
 }
 void MemoryBanks::set_max_pages(size_t new_max, size_t new_hugepages)
 {
@@ -53,13 +250,19 @@ void MemoryBanks::set_max_pages(size_t new_max, size_t new_hugepages)
 	m_mem.reserve(new_banks);
 }
 
-char* MemoryBanks::try_alloc(size_t N, bool try_hugepages)
+char* MemoryBanks::try_alloc(size_t N, bool try_hugepages, bool& hugetlb)
 {
 	char* ptr = (char*)MAP_FAILED;
-	if (try_hugepages && N == 512) {
+	if (try_hugepages && N % MemoryBank::N_HUGEPAGES == 0) {
+		/* Hugepage working memory is reserved up front, so that mmap fails
+		   when there are not enough hugepages, instead of SIGBUS on first
+		   touch in the middle of a fork. The main VM arena keeps its
+		   MAP_NORESERVE behavior. */
+		const int reserve = this->m_hugetlb_banks ? 0 : MAP_NORESERVE;
 		ptr = (char*) mmap(NULL, N * vMemory::PageSize(), PROT_READ | PROT_WRITE,
-			MAP_ANONYMOUS | MAP_PRIVATE | MAP_NORESERVE | MAP_HUGETLB, -1, 0);
+			MAP_ANONYMOUS | MAP_PRIVATE | MAP_HUGETLB | reserve, -1, 0);
 	}
+	hugetlb = (ptr != MAP_FAILED);
 	if (ptr == MAP_FAILED) {
 		return (char*) mmap(NULL, N * vMemory::PageSize(), PROT_READ | PROT_WRITE,
 			MAP_ANONYMOUS | MAP_PRIVATE | MAP_NORESERVE, -1, 0);
@@ -72,27 +275,49 @@ MemoryBank& MemoryBanks::allocate_new_bank(uint64_t addr, unsigned pages)
 	if constexpr (VERBOSE_MEMORY_BANK) {
 		printf("Allocating new memory bank at 0x%lX with %u pages\n", addr, pages);
 	}
-	const bool try_hugepages = m_mem.empty() && this->using_hugepages();
-	if (try_hugepages) {
+	const bool first_hugepages = m_mem.empty() && m_hugepage_pages > 0;
+	if (first_hugepages) {
 		pages = m_hugepage_pages;
 	}
-	char* mem = this->try_alloc(pages, try_hugepages);
+	const bool try_hugepages = first_hugepages || this->m_hugetlb_banks;
+	char* mem = nullptr;
+	bool hugetlb = false;
+	int32_t pool_idx = -1;
+	if (this->m_use_pool && !try_hugepages && pages == MemoryBank::N_PAGES) {
+		pool_idx = MemoryBankPool::get().borrow();
+		if (pool_idx >= 0)
+			mem = MemoryBankPool::get().chunk(pool_idx);
+	}
+	if (mem == nullptr)
+		mem = this->try_alloc(pages, try_hugepages, hugetlb);
 	if (mem == nullptr) {
 		pages = 16;
-		mem = this->try_alloc(pages, false);
+		mem = this->try_alloc(pages, false, hugetlb);
 		this->m_hugepage_pages = 0;
 	}
 
 	const size_t size = pages * vMemory::PageSize();
 	if (mem != nullptr) {
-		m_mem.emplace_back(*this, mem, addr, pages, m_idx);
+		/* Reuse the memory slot of a bank given back to the pool */
+		uint16_t slot;
+		if (!m_free_slots.empty()) {
+			slot = m_free_slots.back();
+			m_free_slots.pop_back();
+		} else {
+			slot = m_idx++;
+		}
+		auto& bank = m_mem.emplace_back(*this, mem, addr, pages, slot);
+		bank.pool_idx = pool_idx;
+		bank.hugetlb = hugetlb;
+		m_frames.insert(addr, size, m_mem.size());
 
 		VirtualMem vmem { addr, mem, size };
 		if constexpr (VERBOSE_MEMORY_BANK) {
 			printf("  Allocated bank %zu (slot %u) at 0x%lX with %u pages (%zu KiB)\n",
-				m_mem.size(), m_idx, addr, pages, size >> 10);
+				m_mem.size(), slot, addr, pages, size >> 10);
 		}
-		m_machine.install_memory(m_idx++, vmem, false);
+		m_machine.install_memory(slot, vmem, false,
+			m_machine.main_memory().dirty_ring_entries != 0);
 
 		return m_mem.back();
 	}
@@ -151,6 +376,8 @@ void MemoryBanks::reset(const MachineOptions& options)
 {
 	/* New maximum pages total in banks. */
 	this->m_max_pages = options.max_cow_mem / vMemory::PageSize();
+	/* The reservoir pages are released along with the banks. */
+	this->cancel_zeroed_pages();
 
 	/* Free memory belonging to banks after the free limit. */
 	//size_t limit_pages = options.reset_free_work_mem / vMemory::PageSize();
@@ -159,14 +386,147 @@ void MemoryBanks::reset(const MachineOptions& options)
 	for (size_t i = 0u; i < m_mem.size(); i++) {
 		/* WARNING: MADV_FREE *does not* immediately free, so use MADV_DONTNEED instead. */
 		if (m_mem[i].dirty_size() > 0)
-			madvise(m_mem[i].mem, m_mem[i].dirty_size(), MADV_DONTNEED);
+			madvise(m_mem[i].mem, m_mem[i].reclaim_size(), MADV_DONTNEED);
 		m_mem[i].n_dirty = 0;
+		m_mem[i].clear_cow_pages();
 	}
 
 	/* Reset page usage for remaining banks */
 	for (auto& bank : m_mem) {
 		bank.n_used = 0;
 	}
+
+	/* Give unneeded banks back to the pool. Another VM may map our
+	   banks while a remote is connected, so keep them all then. */
+	if (this->m_use_pool && !m_machine.has_remote()) {
+		this->return_banks_to_pool(options.reset_free_work_mem / vMemory::PageSize());
+	}
+}
+bool MemoryBanks::take_zeroed_page(MemoryBank::Page& page)
+{
+	if (!m_zeroed_pages.empty()) {
+		page = m_zeroed_pages.back();
+		m_zeroed_pages.pop_back();
+		return true;
+	}
+	/* Pages that are still being zeroed are not waited for */
+	if (m_zeroed_job != nullptr && m_zeroed_taken < m_zeroed_job->ready.load(std::memory_order_acquire)) {
+		page = m_zeroed_job->pages[m_zeroed_taken++];
+		return true;
+	}
+	return false;
+}
+void MemoryBanks::refill_zeroed_pages()
+{
+	if (m_zeroed_job != nullptr) {
+		if (m_zeroed_job->state.load(std::memory_order_acquire) != ZeroedPageJob::DONE)
+			return;
+		/* Keep the zeroed pages that were not taken */
+		const uint32_t ready = m_zeroed_job->ready.load(std::memory_order_acquire);
+		for (uint32_t i = m_zeroed_taken; i < ready; i++)
+			m_zeroed_pages.push_back(m_zeroed_job->pages[i]);
+		this->m_zeroed_job = nullptr;
+		this->m_zeroed_taken = 0;
+	}
+	if (m_zeroed_pages.size() >= m_zeroed_reservoir)
+		return;
+	auto job = std::make_shared<ZeroedPageJob>();
+	try {
+		while (m_zeroed_pages.size() + job->pages.size() < m_zeroed_reservoir) {
+			auto page = this->get_available_bank(1u).get_next_page(1u);
+			page.dirty = false;
+			job->pages.push_back(page);
+		}
+	} catch (const MemoryException&) {
+		/* Out of working memory, the reservoir will be smaller. */
+	}
+	if (!job->pages.empty()) {
+		this->m_zeroed_job = job;
+		PageZeroer::get().submit(std::move(job));
+	}
+}
+void MemoryBanks::cancel_zeroed_pages()
+{
+	if (m_zeroed_job != nullptr) {
+		PageZeroer::cancel(*m_zeroed_job);
+		this->m_zeroed_job = nullptr;
+		this->m_zeroed_taken = 0;
+	}
+	this->m_zeroed_pages.clear();
+}
+void MemoryBanks::return_banks_to_pool(size_t keep_pages)
+{
+	/* Only trailing banks can be removed, keeping the arena contiguous */
+	size_t pages = 0;
+	size_t keep = 0;
+	while (keep < m_mem.size() && (keep == 0 || pages < keep_pages)) {
+		pages += m_mem[keep].n_pages;
+		keep++;
+	}
+	while (m_mem.size() > keep && m_mem.back().pool_idx >= 0)
+	{
+		auto& bank = m_mem.back();
+		if constexpr (VERBOSE_MEMORY_BANK) {
+			printf("Returning bank slot=%u at 0x%lX to the pool\n", bank.idx, bank.addr);
+		}
+		m_machine.delete_memory(bank.idx);
+		m_frames.erase(bank.addr, bank.size());
+		m_free_slots.push_back(bank.idx);
+		m_num_pages -= bank.n_pages;
+		m_arena_next -= bank.size();
+		m_mem.pop_back(); // Gives the memory back to the pool
+	}
+}
+const MemoryBank* MemoryBanks::find_slow(uint64_t addr, size_t asize) const noexcept
+{
+	for (auto& bank : m_mem) {
+		if (bank.within(addr, asize))
+			return &bank;
+	}
+	return nullptr;
+}
+
+void FrameTable::insert(uint64_t addr, uint64_t size, uint16_t value)
+{
+	if (this->scan || size == 0)
+		return;
+	const uint64_t last = (addr + size - 1 - this->base) >> FRAME_SHIFT;
+	if (addr < this->base || last >= MAX_FRAMES || value == AMBIGUOUS) {
+		this->scan = true;
+		this->frames.clear();
+		return;
+	}
+	if (last >= frames.size())
+		frames.resize(last + 1, NONE);
+	for (uint64_t frame = (addr - this->base) >> FRAME_SHIFT; frame <= last; frame++) {
+		frames[frame] = (frames[frame] == NONE) ? value : AMBIGUOUS;
+	}
+}
+void FrameTable::erase(uint64_t addr, uint64_t size)
+{
+	if (this->scan || size == 0 || addr < this->base)
+		return;
+	const uint64_t last = std::min<uint64_t>((addr + size - 1 - this->base) >> FRAME_SHIFT, frames.size() - 1);
+	for (uint64_t frame = (addr - this->base) >> FRAME_SHIFT; frame <= last; frame++) {
+		/* Partially covered frames may still belong to another region */
+		const uint64_t begin = this->base + (frame << FRAME_SHIFT);
+		const uint64_t end = begin + (1ULL << FRAME_SHIFT);
+		frames[frame] = (addr <= begin && end <= addr + size) ? NONE : AMBIGUOUS;
+	}
+}
+void FrameTable::clear(uint64_t new_base)
+{
+	this->base = new_base;
+	this->frames.clear();
+	this->scan = false;
+}
+MemoryBank* MemoryBanks::bank_by_slot(uint32_t slot) noexcept
+{
+	for (auto& bank : m_mem) {
+		if (bank.idx == slot)
+			return &bank;
+	}
+	return nullptr;
 }
 
 MemoryBank::MemoryBank(MemoryBanks& b, char* p, uint64_t a, uint32_t np, uint16_t x)
@@ -179,6 +539,12 @@ MemoryBank::MemoryBank(MemoryBanks& b, char* p, uint64_t a, uint32_t np, uint16_
 }
 MemoryBank::~MemoryBank()
 {
+	if (this->pool_idx >= 0) {
+		if (this->n_dirty > 0)
+			madvise(this->mem, this->reclaim_size(), MADV_DONTNEED);
+		MemoryBankPool::get().give_back(this->pool_idx);
+		return;
+	}
 	munmap(this->mem, this->n_pages * vMemory::PageSize());
 }
 
@@ -201,6 +567,32 @@ MemoryBank::Page MemoryBank::get_next_page(size_t pages)
 	return {(uint64_t *)&mem[offset], addr + offset, pages * vMemory::PageSize(), dirty};
 }
 
+void MemoryBank::record_cow_page(uint64_t paddr, uint64_t vaddr, size_t size)
+{
+	if (this->cow_bitmap.empty()) {
+		this->cow_bitmap.resize((this->n_pages + 63) / 64);
+		this->cow_vaddr.resize(this->n_pages);
+	}
+	const size_t first = (paddr - this->addr) / vMemory::PageSize();
+	const size_t count = size / vMemory::PageSize();
+	assert(first + count <= this->n_pages);
+	for (size_t page = first; page < first + count; page++) {
+		const uint64_t bit = 1ULL << (page % 64);
+		if ((cow_bitmap[page / 64] & bit) == 0) {
+			cow_bitmap[page / 64] |= bit;
+			this->n_cow_pages++;
+		}
+		cow_vaddr[page] = vaddr + (page - first) * vMemory::PageSize();
+	}
+}
+void MemoryBank::clear_cow_pages() noexcept
+{
+	if (this->n_cow_pages != 0) {
+		std::fill(cow_bitmap.begin(), cow_bitmap.end(), 0);
+		this->n_cow_pages = 0;
+	}
+}
+
 VirtualMem MemoryBank::to_vmem() const noexcept
 {
 	return VirtualMem {this->addr, this->mem, this->size()};
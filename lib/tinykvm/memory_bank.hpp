@@ -1,5 +1,7 @@
 #pragma once
 #include <array>
+#include <memory>
+#include <utility>
 #include <vector>
 #include "common.hpp"
 #include "virtual_mem.hpp"
@@ -7,6 +9,7 @@
 namespace tinykvm {
 struct Machine;
 struct MemoryBanks;
+struct ZeroedPageJob;
 
 struct MemoryBank {
 	// This is 1x 2MB page (second-level amd64 page)
@@ -20,6 +23,16 @@ struct MemoryBank {
 	const uint32_t n_pages;
 	const uint16_t idx;
 	MemoryBanks& banks;
+	/* Index in the process-wide bank pool, or -1 when not pooled */
+	int32_t pool_idx = -1;
+	/* Backed by hugepages (MAP_HUGETLB) */
+	bool hugetlb = false;
+	/* Bitmap of bank pages that back CoW-written leaf user pages,
+	   along with the guest address each page is mapped at. Used
+	   by fork_reset to restore pages without walking pagetables. */
+	uint32_t n_cow_pages = 0;
+	std::vector<uint64_t> cow_bitmap;
+	std::vector<uint64_t> cow_vaddr;
 
 	bool within(uint64_t a, uint64_t s) const noexcept {
 		return (a >= addr) && (a + s <= addr + this->size()) && (a <= a + s);
@@ -32,6 +45,12 @@ struct MemoryBank {
 	}
 	uint64_t size() const noexcept { return uint64_t(n_pages) * 4096; }
 	uint64_t dirty_size() const noexcept { return uint64_t(n_dirty) * 4096; }
+	/* Hugepage-backed banks can only be given back in 2MB units */
+	uint64_t reclaim_size() const noexcept {
+		if (hugetlb)
+			return (dirty_size() + (2ULL << 20) - 1) & ~((2ULL << 20) - 1);
+		return dirty_size();
+	}
 	bool empty() const noexcept { return n_used == n_pages; }
 	bool room_for(size_t pages) const noexcept;
 	struct Page {
@@ -42,21 +61,67 @@ struct MemoryBank {
 	};
 	Page get_next_page(size_t n_pages);
 
+	void record_cow_page(uint64_t paddr, uint64_t vaddr, size_t size);
+	bool has_cow_page(size_t page) const noexcept {
+		return page < cow_vaddr.size() && (cow_bitmap[page / 64] & (1ULL << (page % 64))) != 0;
+	}
+	void forget_cow_page(size_t page) noexcept {
+		if (has_cow_page(page)) {
+			cow_bitmap[page / 64] &= ~(1ULL << (page % 64));
+			this->n_cow_pages--;
+		}
+	}
+	void clear_cow_pages() noexcept;
+	template <typename Callback>
+	void foreach_cow_page(Callback&& callback);
+
 	VirtualMem to_vmem() const noexcept;
 
 	MemoryBank(MemoryBanks&, char*, uint64_t, uint32_t n, uint16_t idx);
 	~MemoryBank();
 };
 
+/* Direct-index table from 2MB physical frames to (index + 1) of the
+   region covering the frame. Frames shared by several regions are
+   AMBIGUOUS, and must be looked up the slow way. */
+struct FrameTable {
+	static constexpr uint16_t NONE = 0;
+	static constexpr uint16_t AMBIGUOUS = 0xFFFF;
+	static constexpr unsigned FRAME_SHIFT = 21;
+	static constexpr size_t   MAX_FRAMES = 1u << 16; /* 128GB */
+
+	uint16_t lookup(uint64_t addr) const noexcept {
+		if (UNLIKELY(this->scan))
+			return AMBIGUOUS;
+		/* Addresses below base wrap around and end up out of bounds */
+		const uint64_t frame = (addr - this->base) >> FRAME_SHIFT;
+		return (frame < frames.size()) ? frames[frame] : NONE;
+	}
+	void insert(uint64_t addr, uint64_t size, uint16_t value);
+	void erase(uint64_t addr, uint64_t size);
+	void clear(uint64_t new_base);
+
+	uint64_t base = 0;
+	std::vector<uint16_t> frames;
+	/* The regions did not fit, always look up the slow way */
+	bool scan = false;
+};
+
 struct MemoryBanks {
 	static constexpr unsigned FIRST_BANK_IDX = 2;
 	static constexpr uint64_t ARENA_BASE_ADDRESS = 0x7000000000;
 
 	MemoryBanks(Machine&, const MachineOptions&);
+	~MemoryBanks();
 	void init_from(const MemoryBanks&);
 
 	MemoryBank& get_available_bank(size_t n_pages);
 	void reset(const MachineOptions&);
+	/* Pre-zeroed page reservoir, zeroed on a background thread */
+	bool take_zeroed_page(MemoryBank::Page&);
+	void refill_zeroed_pages();
+	void cancel_zeroed_pages();
+	bool has_zeroed_page_reservoir() const noexcept { return m_zeroed_reservoir > 0; }
 	void set_max_pages(size_t new_max, size_t new_hugepages);
 	size_t max_pages() const noexcept { return m_max_pages; }
 	uint64_t arena_begin() const noexcept { return m_arena_begin; }
@@ -64,7 +129,7 @@ struct MemoryBanks {
 		return m_idx++;
 	}
 
-	bool using_hugepages() const noexcept { return m_hugepage_pages > 0; }
+	bool using_hugepages() const noexcept { return m_hugepage_pages > 0 || m_hugetlb_banks; }
 	size_t banks_with_hugepages() const noexcept { return m_hugepage_pages / MemoryBank::N_PAGES; }
 
 	auto begin() { return m_mem.begin(); }
@@ -73,12 +138,31 @@ struct MemoryBanks {
 	auto end() const   { return m_mem.cend(); }
 	size_t size() const noexcept { return m_mem.size(); }
 	const MemoryBank& at(size_t i) const { return m_mem.at(i); }
+	MemoryBank* bank_at(uint64_t paddr) noexcept { return find(paddr, 4096); }
+	/* Find the bank that contains the whole range, or nullptr */
+	MemoryBank* find(uint64_t addr, size_t asize) noexcept {
+		return const_cast<MemoryBank*> (std::as_const(*this).find(addr, asize));
+	}
+	const MemoryBank* find(uint64_t addr, size_t asize) const noexcept {
+		const uint16_t value = m_frames.lookup(addr);
+		if (LIKELY(value != FrameTable::AMBIGUOUS)) {
+			if (value != FrameTable::NONE && m_mem[value - 1].within(addr, asize))
+				return &m_mem[value - 1];
+			return nullptr;
+		}
+		return find_slow(addr, asize);
+	}
+	MemoryBank* bank_by_slot(uint32_t slot) noexcept;
 
 private:
 	MemoryBank& allocate_new_bank(uint64_t addr, unsigned pages);
-	char* try_alloc(size_t N, bool try_hugepages);
+	char* try_alloc(size_t N, bool try_hugepages, bool& hugetlb);
+	void return_banks_to_pool(size_t keep_pages);
+	const MemoryBank* find_slow(uint64_t addr, size_t asize) const noexcept;
 
 	std::vector<MemoryBank> m_mem;
+	/* 2MB frames of the arena to bank index */
+	FrameTable m_frames;
 	Machine& m_machine;
 	uint64_t m_arena_begin;
 	uint64_t m_arena_next;
@@ -88,8 +172,36 @@ private:
 	uint32_t m_num_pages = 0;
 	/* Max number of pages in all the banks */
 	uint32_t m_max_pages;
+	/* Borrow banks from the process-wide pool */
+	bool m_use_pool = false;
+	/* Back every bank with hugepages, when possible */
+	bool m_hugetlb_banks = false;
+	/* Free dirty bank pages on a background thread */
+	/* Memory slots of banks given back to the pool */
+	std::vector<uint16_t> m_free_slots;
+	/* Pages taken from the banks and zeroed ahead of time */
+	std::vector<MemoryBank::Page> m_zeroed_pages;
+	uint32_t m_zeroed_reservoir = 0;
+	/* Pages being zeroed in the background, taken in order */
+	std::shared_ptr<ZeroedPageJob> m_zeroed_job;
+	uint32_t m_zeroed_taken = 0;
 
 	friend struct MemoryBank;
 };
 
+template <typename Callback>
+inline void MemoryBank::foreach_cow_page(Callback&& callback)
+{
+	if (this->n_cow_pages == 0)
+		return;
+	for (size_t i = 0; i < cow_bitmap.size(); i++) {
+		uint64_t bits = cow_bitmap[i];
+		while (bits != 0) {
+			const size_t page = i * 64 + __builtin_ctzll(bits);
+			bits &= bits - 1;
+			callback(cow_vaddr[page], &mem[page * 4096]);
+		}
+	}
+}
+
 }
@@ -188,6 +188,10 @@ Machine::address_t Machine::mmap_allocate(size_t bytes, int prot, bool huge)
 		this->mmap_cache().current() = (this->mmap_cache().current() + bytes + 0x1FFFFFLL) & ~0x1FFFFFLL;
 	}
 	const address_t result = this->mmap_cache().current();
+	/* The argument arena is shared with every fork */
+	if (UNLIKELY(result + bytes > m_arena_begin)) {
+		throw MemoryException("MMapCache: Out of memory (argument arena)", result, bytes);
+	}
 	this->mmap_cache().current() += bytes;
 
 	if (this->mmap_cache().track_used_ranges())
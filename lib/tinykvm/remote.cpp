@@ -49,6 +49,7 @@ void Machine::remote_update_gigapage_mappings(Machine& remote, bool forced)
 		const auto begin = remote_vmem.physbase >> 30;
 		const auto end   = (remote_vmem.remote_end + 0x3FFFFFFF) >> 30;
 
+		caller.memory.tlb.invalidate();
 		for (size_t i = begin; i < end; i++) {
 			if constexpr (VERBOSE_REMOTE) {
 				if (main_pdpt[i] != remote_pdpt[i]) {
@@ -84,6 +85,12 @@ void Machine::remote_connect(Machine& remote, bool connect_now)
 	if (&remote != this->m_remote) {
 		if (&remote == this)
 			throw MachineException("Cannot connect a VM to itself");
+		if (this->has_snapshot_remote()) {
+			/* The page tables in the snapshot already map the remote */
+			if (remote_vmem.physbase != m_snapshot_remote.physbase || remote_vmem.size != m_snapshot_remote.size)
+				throw MachineException("Remote VM does not match the remote in the snapshot", remote_vmem.physbase);
+			this->m_snapshot_remote = {};
+		}
 		if (this->m_remote != nullptr) {
 			this->delete_memory(1);
 			this->memory.delete_foreign_mmap_ranges();
@@ -103,6 +110,7 @@ void Machine::remote_connect(Machine& remote, bool connect_now)
 
 	// Finalize
 	this->m_remote = &remote;
+	this->memory.tlb.invalidate();
 	if constexpr (VERBOSE_REMOTE) {
 		fprintf(stderr, "Remote connected: this VM %p remote VM %p (%s)\n",
 			this, &remote, connect_now ? "just-in-time" : "setup");
@@ -385,6 +393,7 @@ Machine::address_t Machine::remote_disconnect()
 	{
 		main_pdpt[i] = 0; // Clear entry
 	}
+	this->memory.tlb.invalidate();
 
 	// Restore original FSBASE
 	auto tls_base = this->vcpu.remote_original_tls_base;
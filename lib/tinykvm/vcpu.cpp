@@ -21,7 +21,12 @@
 #include "amd64/usercode.hpp"
 extern "C" int close(int);
 extern "C" void tinykvm_timer_signal_handler(int);
+static struct kvm_lapic_state pristine_lapic;
+static std::once_flag pristine_lapic_once;
 #define TINYKVM_USE_SYNCED_SREGS 1
+#ifndef KVM_CAP_X86_APIC_BUS_CYCLES_NS
+#define KVM_CAP_X86_APIC_BUS_CYCLES_NS 237
+#endif
 
 #ifndef SYS_gettid
 #error "SYS_gettid unavailable on this system"
@@ -44,6 +49,8 @@ namespace tinykvm {
 		struct kvm_cpuid_entry2 entries[100];
 	} kvm_cpuid;
 	static long vcpu_mmap_size = 0;
+	/* Nanoseconds per local APIC timer tick, see below */
+	uint64_t lapic_timer_ns_per_tick = 16;
 
 TINYKVM_COLD()
 void initialize_vcpu_stuff(int kvm_fd)
@@ -58,6 +65,13 @@ void initialize_vcpu_stuff(int kvm_fd)
 	if (ioctl(kvm_fd, KVM_GET_SUPPORTED_CPUID, &kvm_cpuid) < 0) {
 		throw MachineException("KVM_GET_SUPPORTED_CPUID failed");
 	}
+
+	/* The local APIC timer counts APIC bus cycles, divided by 16.
+	   KVM reports the bus cycle length since Linux 6.11, and before
+	   that it was always 1ns (a 1GHz bus). */
+	const int bus_cycle_ns =
+		ioctl(kvm_fd, KVM_CHECK_EXTENSION, KVM_CAP_X86_APIC_BUS_CYCLES_NS);
+	lapic_timer_ns_per_tick = 16 * (bus_cycle_ns > 0 ? bus_cycle_ns : 1);
 }
 
 void* Machine::create_vcpu_timer()
@@ -86,8 +100,11 @@ void vCPU::init(int id, Machine& machine, const MachineOptions& options)
 			Machine::machine_exception("Failed to KVM_CREATE_VCPU");
 		}
 	}
-	if (this->timer_id == nullptr) {
+	this->use_lapic_timer = options.lapic_timeouts;
+	this->use_watchdog = options.watchdog_timeouts || this->use_lapic_timer;
+	if (this->timer_id == nullptr && !this->use_watchdog) {
 		this->timer_id = Machine::create_vcpu_timer();
+		this->timer_tid = gettid();
 	}
 	if (this->kvm_run == nullptr) {
 		kvm_run = (struct kvm_run*) ::mmap(NULL, vcpu_mmap_size,
@@ -107,7 +124,11 @@ void vCPU::init(int id, Machine& machine, const MachineOptions& options)
 		if (ioctl(this->fd, KVM_SET_CPUID2, &kvm_cpuid) < 0) {
 			Machine::machine_exception("KVM_SET_CPUID2 failed");
 		}
+		if (this->use_lapic_timer) {
+			this->setup_lapic_timer();
+		}
 	}
+	this->map_dirty_ring();
 
 	// Only master VMs need special registers
 	// Forked VMs derive special register from the master VM
@@ -215,7 +236,12 @@ void vCPU::smp_init(int id, Machine& machine)
 	if (UNLIKELY(this->fd < 0)) {
 		Machine::machine_exception("Failed to KVM_CREATE_VCPU");
 	}
-	this->timer_id = Machine::create_vcpu_timer();
+	this->use_watchdog = machine.cpu().use_watchdog;
+	this->use_lapic_timer = machine.cpu().use_lapic_timer;
+	if (!this->use_watchdog) {
+		this->timer_id = Machine::create_vcpu_timer();
+		this->timer_tid = gettid();
+	}
 
 	kvm_run = (struct kvm_run*) ::mmap(NULL, vcpu_mmap_size,
 		PROT_READ | PROT_WRITE, MAP_SHARED, this->fd, 0);
@@ -227,6 +253,7 @@ void vCPU::smp_init(int id, Machine& machine)
 #ifdef TINYKVM_USE_SYNCED_SREGS
 	kvm_run->kvm_valid_regs |= KVM_SYNC_X86_SREGS;
 #endif
+	this->map_dirty_ring();
 
 	const kvm_mp_state state {
 		.mp_state = KVM_MP_STATE_RUNNABLE
@@ -239,6 +266,9 @@ void vCPU::smp_init(int id, Machine& machine)
 	if (ioctl(this->fd, KVM_SET_CPUID2, &kvm_cpuid) < 0) {
 		Machine::machine_exception("KVM_SET_CPUID2 failed");
 	}
+	if (this->use_lapic_timer) {
+		this->setup_lapic_timer();
+	}
 
 	/* Extended control registers */
 	if (ioctl(this->fd, KVM_SET_XCRS, &master_xregs) < 0) {
@@ -273,6 +303,123 @@ void vCPU::smp_init(int id, Machine& machine)
 	this->set_special_registers(sregs);
 }
 
+uint64_t vCPU::lapic_base() const noexcept
+{
+	return AMD64_APIC_BASE_ADDR | AMD64_MSR_X2APIC_ENABLE
+		| (this->cpu_id == 0 ? AMD64_APIC_BASE_BSP : 0);
+}
+void vCPU::setup_lapic_timer()
+{
+	/* Enable the local APIC in x2APIC mode, so that it can be programmed
+	   with MSRs, and make the timer a one-shot timer with a vector that
+	   is handled by the interrupt handlers. */
+	struct {
+		__u32 nmsrs; /* number of msrs in entries */
+		__u32 pad = 0;
+
+		struct kvm_msr_entry entries[4];
+	} msrs;
+	msrs.nmsrs = 4;
+	msrs.entries[0].index = AMD64_MSR_APICBASE;
+	msrs.entries[0].data  = this->lapic_base();
+	msrs.entries[1].index = AMD64_MSR_X2APIC_SVR;
+	msrs.entries[1].data  = AMD64_APIC_SVR_ENABLE | 0xFF;
+	msrs.entries[2].index = AMD64_MSR_X2APIC_TIMER_DCR;
+	msrs.entries[2].data  = AMD64_APIC_TIMER_DIV16;
+	msrs.entries[3].index = AMD64_MSR_X2APIC_LVT_TIMER;
+	msrs.entries[3].data  = AMD64_APIC_TIMER_VECTOR;
+
+	if (ioctl(this->fd, KVM_SET_MSRS, &msrs) < (int)msrs.nmsrs) {
+		Machine::machine_exception("KVM_SET_MSRS: failed to set up local APIC timer");
+	}
+	/* Synced special registers must not disable the APIC again */
+	this->kvm_run->s.regs.sregs.apic_base = this->lapic_base();
+
+	/* Remember the freshly set up local APIC of the boot vCPU, so
+	   that pooled vCPUs can be restored to it. It's the same for
+	   every VM, so once per process is enough. */
+	if (this->cpu_id == 0) {
+		std::call_once(pristine_lapic_once, [this] {
+			if (ioctl(this->fd, KVM_GET_LAPIC, &pristine_lapic) < 0) {
+				Machine::machine_exception("KVM_GET_LAPIC failed");
+			}
+		});
+	}
+}
+
+void vCPU::reset_interrupt_state()
+{
+	/* Exceptions, interrupts and NMIs that were about to be injected
+	   when the last run ended, eg. by a timeout. */
+	struct kvm_vcpu_events events {};
+	events.flags = KVM_VCPUEVENT_VALID_NMI_PENDING | KVM_VCPUEVENT_VALID_SHADOW;
+	if (ioctl(this->fd, KVM_SET_VCPU_EVENTS, &events) < 0) {
+		Machine::machine_exception("KVM_SET_VCPU_EVENTS failed");
+	}
+	/* A timer interrupt may still be pending or in service, and the
+	   timer itself may be counting down. */
+	if (this->use_lapic_timer) {
+		if (ioctl(this->fd, KVM_SET_LAPIC, &pristine_lapic) < 0) {
+			Machine::machine_exception("KVM_SET_LAPIC failed");
+		}
+		this->lapic_eoi_pending = false;
+		this->lapic_deadline = 0;
+	}
+}
+
+void vCPU::map_dirty_ring()
+{
+	const uint32_t entries = machine().main_memory().dirty_ring_entries;
+	if (entries == 0 || this->dirty_gfns != nullptr)
+		return;
+	auto* ring = ::mmap(NULL, entries * sizeof(struct kvm_dirty_gfn),
+		PROT_READ | PROT_WRITE, MAP_SHARED, this->fd,
+		KVM_DIRTY_LOG_PAGE_OFFSET * vMemory::PageSize());
+	if (UNLIKELY(ring == MAP_FAILED)) {
+		Machine::machine_exception("Failed to map KVM dirty ring");
+	}
+	this->dirty_gfns = (struct kvm_dirty_gfn *)ring;
+	this->dirty_gfn_count = entries;
+	this->dirty_gfn_index = 0;
+}
+size_t vCPU::harvest_dirty_ring(std::vector<uint64_t>& pages) const
+{
+	if (this->dirty_gfns == nullptr)
+		return 0;
+	size_t harvested = 0;
+	while (true) {
+		auto& gfn = dirty_gfns[dirty_gfn_index & (dirty_gfn_count - 1)];
+		const uint32_t flags = __atomic_load_n(&gfn.flags, __ATOMIC_ACQUIRE);
+		if ((flags & KVM_DIRTY_GFN_F_DIRTY) == 0)
+			break;
+		pages.push_back(uint64_t(gfn.slot & 0xFFFF) << 32 | gfn.offset);
+		__atomic_store_n(&gfn.flags, KVM_DIRTY_GFN_F_RESET, __ATOMIC_RELEASE);
+		this->dirty_gfn_index++;
+		harvested++;
+	}
+	if (harvested > 0) {
+		if (ioctl(m_machine->fd, KVM_RESET_DIRTY_RINGS, 0) < 0) {
+			Machine::machine_exception("KVM_RESET_DIRTY_RINGS failed");
+		}
+	}
+	return harvested;
+}
+
+void vCPU::adopt_resources(const vCPU& other)
+{
+	this->fd = other.fd;
+	this->timer_id = other.timer_id;
+	this->timer_tid = other.timer_tid;
+	this->use_watchdog = other.use_watchdog;
+	this->watchdog_slot = other.watchdog_slot;
+	this->use_lapic_timer = other.use_lapic_timer;
+	this->lapic_eoi_pending = other.lapic_eoi_pending;
+	this->kvm_run = other.kvm_run;
+	this->dirty_gfns = other.dirty_gfns;
+	this->dirty_gfn_count = other.dirty_gfn_count;
+	this->dirty_gfn_index = other.dirty_gfn_index;
+}
+
 void vCPU::deinit()
 {
 	if (this->fd > 0) {
@@ -281,8 +428,14 @@ void vCPU::deinit()
 	if (kvm_run != nullptr) {
 		munmap(kvm_run, vcpu_mmap_size);
 	}
+	if (dirty_gfns != nullptr) {
+		munmap(dirty_gfns, dirty_gfn_count * sizeof(struct kvm_dirty_gfn));
+	}
 
-	timer_delete(this->timer_id);
+	if (this->timer_id != nullptr) {
+		timer_delete(this->timer_id);
+	}
+	this->destroy_watchdog_slot();
 }
 
 const tinykvm_x86regs& vCPU::registers() const
@@ -343,8 +496,14 @@ void vCPU::set_special_registers(const kvm_sregs& sregs)
 	/* Only assign if there is a mismatch. */
 	if (dest_regs != &sregs)
 		*dest_regs = sregs;
+	/* Special registers may come from a machine without a local APIC */
+	if (this->use_lapic_timer)
+		dest_regs->apic_base = this->lapic_base();
 #else
-	if (ioctl(this->fd, KVM_SET_SREGS, &sregs) < 0) {
+	struct kvm_sregs copy = sregs;
+	if (this->use_lapic_timer)
+		copy.apic_base = this->lapic_base();
+	if (ioctl(this->fd, KVM_SET_SREGS, &copy) < 0) {
 		Machine::machine_exception("KVM_SET_SREGS failed");
 	}
 #endif
@@ -426,13 +585,17 @@ void Machine::prepare_copy_on_write(size_t max_work_mem,
 	   effectively turning it into a shared memory area for all. */
 	if (shared_memory_boundary == 0)
 		shared_memory_boundary = UINT64_MAX;
+	/* The argument arena stays writable, and is shared with forks */
+	if (shared_memory_boundary > m_arena_begin)
+		shared_memory_boundary = m_arena_begin;
 
 	// Visualizing the page tables after makecow should show that all
 	// relevant user-writable pages have been made read-only and cloneable
 	//print_pagetables(this->memory);
 
 	/* Make this machine runnable again using itself
-	   as the master VM. TODO: Enable hugepages for CoW mode? */
+	   as the master VM. Hugepage-backed banks are controlled
+	   by MachineOptions::hugepage_working_memory. */
 	memory.banks.set_max_pages(max_work_mem / PAGE_SIZE, 0u);
 	/* Without working memory we will not be able to make
 	   this master VM usable after prepare_copy_on_write. */
@@ -447,6 +610,7 @@ void Machine::prepare_copy_on_write(size_t max_work_mem,
 		   flatten them into the main memory. */
 		/// XXX: Implement memory flattening
 		memory.page_tables = memory.physbase + PT_ADDR;
+		memory.tlb.invalidate();
 		struct kvm_sregs sregs = this->get_special_registers();
 
 		/* Page table entry will be cloned at the start */
@@ -6,12 +6,18 @@
 namespace tinykvm
 {
 	struct Machine;
+	struct WatchdogSlot;
 
 	struct vCPU
 	{
 		void init(int id, Machine&, const MachineOptions&);
 		void smp_init(int id, Machine &);
 		void deinit();
+		/* Take over the KVM resources of a vCPU from a pool */
+		void adopt_resources(const vCPU& other);
+		/* Drop pending events and restore the local APIC to the state
+		   it was set up with, before the vCPU is given to a pool */
+		void reset_interrupt_state();
 		tinykvm_x86regs& registers();
 		const tinykvm_x86regs& registers() const;
 		void set_registers(const struct tinykvm_x86regs &);
@@ -46,6 +52,9 @@ namespace tinykvm
 
 		void set_vcpu_table_at(unsigned index, int value);
 		bool timed_out() const;
+		/* Append (slot << 32) | page index of each harvested dirty ring
+		   entry to the vector, then reset the harvested entries. */
+		size_t harvest_dirty_ring(std::vector<uint64_t>&) const;
 
 		int fd = -1;
 		int cpu_id = 0;
@@ -54,17 +63,37 @@ namespace tinykvm
 		uint8_t current_exception = 0;
 		uint32_t timer_ticks = 0;
 		void* timer_id = nullptr;
+		int timer_tid = 0; /* The thread the timer signals */
+		/* Use the execution watchdog instead of a POSIX timer */
+		bool use_watchdog = false;
+		struct WatchdogSlot* watchdog_slot = nullptr;
+		/* Use the in-kernel local APIC timer for timeouts */
+		bool use_lapic_timer = false;
+		bool lapic_eoi_pending = false;
+		uint64_t lapic_deadline = 0;
 		uint64_t last_fault_address = 0;
+		/* Sequential write faults grow the fault-ahead window */
+		uint64_t fault_ahead_next = 0;
+		uint32_t fault_ahead_pages = 0;
 		uint64_t remote_return_address = 0;
 		uint64_t remote_original_tls_base = 0;
 		std::mutex* remote_serializer = nullptr;
 
 	private:
 		struct kvm_run* kvm_run = nullptr;
+		struct kvm_dirty_gfn* dirty_gfns = nullptr;
+		uint32_t dirty_gfn_count = 0;
+		mutable uint32_t dirty_gfn_index = 0;
 		Machine* m_machine = nullptr;
 		Machine* m_original_machine = nullptr;
 
 		uint64_t vcpu_table_addr() const noexcept;
+		void map_dirty_ring();
+		void destroy_watchdog_slot();
+		uint64_t lapic_base() const noexcept;
+		void setup_lapic_timer();
+		void arm_lapic_timer(uint64_t now);
+		void program_lapic_timer(uint32_t count);
 	};
 
 } // namespace tinykvm
@@ -3,6 +3,7 @@
 #include "amd64/amd64.hpp"
 #include "amd64/gdt.hpp"
 #include "amd64/idt.hpp"
+#include "amd64/lapic.hpp"
 #include "amd64/memory_layout.hpp"
 #include "amd64/paging.hpp"
 #include "util/scoped_profiler.hpp"
@@ -10,6 +11,15 @@
 #include <sys/ioctl.h>
 #include <time.h>
 #include <signal.h>
+#include <pthread.h>
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
 static constexpr bool VERBOSE_REMOTE = false;
 #define PRINTER(printer, buffer, fmt, ...) \
 	printer(buffer, \
@@ -32,6 +42,228 @@ void tinykvm_timer_signal_handler(int sig) {
 
 namespace tinykvm {
 	static constexpr bool VERBOSE_TIMER = false;
+	static constexpr uint32_t MAX_FAULT_AHEAD_PAGES = 32;
+	/* Nanoseconds per local APIC timer tick, as reported by KVM */
+	extern uint64_t lapic_timer_ns_per_tick;
+	/* Grace period before the watchdog catches vCPUs that mask interrupts */
+	static constexpr uint32_t LAPIC_WATCHDOG_SLACK_MS = 20;
+
+/* A vCPU execution deadline, owned by the vCPU and queued in the watchdog */
+struct WatchdogSlot {
+	/* Monotonic deadline in nanoseconds, or one of the states below */
+	std::atomic<uint64_t> deadline { 0 };
+	struct kvm_run* run = nullptr;
+	pthread_t thread {};
+	/* The time the watchdog will next look at the slot, or 0 when it is
+	   not in the heap. Heap entries for any other time are stale. */
+	std::atomic<uint64_t> queued { 0 };
+	/* In the list of slots that were queued by arm() */
+	std::atomic<bool> pending { false };
+	WatchdogSlot* next_pending = nullptr;
+	/* Watchdog only, under its mutex */
+	uint64_t last_kick = 0;
+	uint32_t heap_refs = 0;
+	bool destroyed = false;
+};
+
+/* A process-wide watchdog thread enforcing execution timeouts for all
+   vCPUs using MachineOptions::watchdog_timeouts. Arming a timeout is a
+   store of the deadline into the vCPU slot, and disarming it is a single
+   exchange. The watchdog keeps a heap of the times at which it must look
+   at each slot. A slot that is armed again before its previous deadline
+   stays in the heap, and is moved to the new deadline when the old one
+   comes up, so back-to-back calls do not touch the heap at all. Only a
+   slot that is not in the heap, or that is armed with an earlier deadline,
+   is handed to the watchdog through a lock-free list.
+   Expired vCPUs are kicked out of KVM_RUN with immediate_exit and a
+   signal. Like the POSIX timers, the signal is repeated every 20ms
+   until the vCPU disarms. */
+struct ExecutionWatchdog {
+	static constexpr uint64_t DISARMED = 0;
+	static constexpr uint64_t FIRING   = 1;
+	static constexpr uint64_t FIRED    = 2;
+	static constexpr auto ARMED_TICK = std::chrono::milliseconds(1);
+	static constexpr auto IDLE_TICK  = std::chrono::milliseconds(10);
+	static constexpr uint64_t REKICK_NS = 20'000'000ULL;
+
+	static ExecutionWatchdog& get() {
+		static ExecutionWatchdog watchdog;
+		return watchdog;
+	}
+	static uint64_t now() noexcept {
+		struct timespec ts;
+		clock_gettime(CLOCK_MONOTONIC, &ts);
+		return ts.tv_sec * 1'000'000'000ULL + ts.tv_nsec;
+	}
+
+	WatchdogSlot* create_slot()
+	{
+		std::lock_guard<std::mutex> lock(m_mtx);
+		if (!m_thread.joinable()) {
+			signal(SIGUSR2, tinykvm_timer_signal_handler);
+			m_thread = std::thread(&ExecutionWatchdog::loop, this);
+		}
+		return new WatchdogSlot;
+	}
+	/* The slot must be disarmed */
+	void destroy_slot(WatchdogSlot* slot)
+	{
+		std::lock_guard<std::mutex> lock(m_mtx);
+		this->drain_pending();
+		/* The watchdog frees the slot when its last heap entry comes up */
+		if (slot->heap_refs == 0)
+			delete slot;
+		else
+			slot->destroyed = true;
+	}
+
+	static void arm(WatchdogSlot& slot, struct kvm_run* run, uint32_t ticks) noexcept
+	{
+		slot.run = run;
+		slot.thread = pthread_self();
+		const uint64_t deadline = now() + ticks * 1'000'000ULL;
+		slot.deadline.store(deadline);
+		uint64_t queued = slot.queued.load();
+		while (queued == 0 || deadline < queued) {
+			if (slot.queued.compare_exchange_weak(queued, deadline)) {
+				get().push_pending(slot);
+				break;
+			}
+		}
+	}
+	/* Returns true if the deadline expired */
+	static bool disarm(WatchdogSlot& slot) noexcept
+	{
+		uint64_t deadline = slot.deadline.load(std::memory_order_relaxed);
+		while (true) {
+			if (UNLIKELY(deadline == FIRING)) {
+				/* The watchdog is kicking us right now */
+				__builtin_ia32_pause();
+				deadline = slot.deadline.load(std::memory_order_acquire);
+				continue;
+			}
+			if (slot.deadline.compare_exchange_weak(deadline, DISARMED, std::memory_order_acq_rel))
+				break;
+		}
+		if (UNLIKELY(deadline == FIRED)) {
+			__atomic_store_n(&slot.run->immediate_exit, 0, __ATOMIC_RELAXED);
+			return true;
+		}
+		return false;
+	}
+
+private:
+	using HeapEntry = std::pair<uint64_t, WatchdogSlot*>;
+
+	void push_pending(WatchdogSlot& slot) noexcept
+	{
+		/* Already listed: The watchdog reads the queued time when draining */
+		if (slot.pending.exchange(true, std::memory_order_acq_rel))
+			return;
+		WatchdogSlot* head = m_pending.load(std::memory_order_relaxed);
+		do {
+			slot.next_pending = head;
+		} while (!m_pending.compare_exchange_weak(head, &slot,
+			std::memory_order_release, std::memory_order_relaxed));
+	}
+	void drain_pending()
+	{
+		WatchdogSlot* slot = m_pending.exchange(nullptr, std::memory_order_acquire);
+		while (slot != nullptr) {
+			WatchdogSlot* next = slot->next_pending;
+			slot->pending.store(false);
+			this->enqueue(*slot, slot->queued.load());
+			slot = next;
+		}
+	}
+	void enqueue(WatchdogSlot& slot, uint64_t when)
+	{
+		if (when == 0)
+			return;
+		m_heap.emplace_back(when, &slot);
+		std::push_heap(m_heap.begin(), m_heap.end(), std::greater<HeapEntry>());
+		slot.heap_refs++;
+	}
+	/* Look at the slot again later, unless arm() has queued it already */
+	void requeue(WatchdogSlot& slot, uint64_t queued, uint64_t when)
+	{
+		if (slot.queued.compare_exchange_strong(queued, when))
+			this->enqueue(slot, when);
+	}
+	/* Send the signal, making disarm() wait until it has been sent */
+	static void kick(WatchdogSlot& slot, uint64_t from, uint64_t t)
+	{
+		if (!slot.deadline.compare_exchange_strong(from, FIRING))
+			return;
+		__atomic_store_n(&slot.run->immediate_exit, 1, __ATOMIC_RELAXED);
+		slot.last_kick = t;
+		pthread_kill(slot.thread, SIGUSR2);
+		slot.deadline.store(FIRED, std::memory_order_release);
+		if constexpr (VERBOSE_TIMER) {
+			printf("Watchdog %p triggered\n", &slot);
+		}
+	}
+	void expire(WatchdogSlot& slot, uint64_t queued, uint64_t t)
+	{
+		const uint64_t deadline = slot.deadline.load();
+		if (deadline == DISARMED) {
+			/* Leave the heap, unless armed again in the meantime */
+			slot.queued.store(0);
+			const uint64_t rearmed = slot.deadline.load();
+			if (rearmed != DISARMED)
+				this->requeue(slot, 0, rearmed);
+		} else if (deadline == FIRED) {
+			/* Still running, eg. in a blocking system call */
+			if (t - slot.last_kick >= REKICK_NS)
+				kick(slot, FIRED, t);
+			this->requeue(slot, queued, slot.last_kick + REKICK_NS);
+		} else if (deadline > t) {
+			/* Armed again, with a later deadline */
+			this->requeue(slot, queued, deadline);
+		} else {
+			kick(slot, deadline, t);
+			this->requeue(slot, queued, t + REKICK_NS);
+		}
+	}
+	void loop()
+	{
+		std::unique_lock<std::mutex> lock(m_mtx);
+		while (!m_stop) {
+			this->drain_pending();
+			const uint64_t t = now();
+			while (!m_heap.empty() && m_heap.front().first <= t) {
+				std::pop_heap(m_heap.begin(), m_heap.end(), std::greater<HeapEntry>());
+				const auto [queued, slot] = m_heap.back();
+				m_heap.pop_back();
+				slot->heap_refs--;
+				if (slot->destroyed) {
+					if (slot->heap_refs == 0)
+						delete slot;
+				} else if (slot->queued.load() == queued) {
+					this->expire(*slot, queued, t);
+				}
+			}
+			m_cond.wait_for(lock, m_heap.empty() ? IDLE_TICK : ARMED_TICK);
+		}
+	}
+	~ExecutionWatchdog()
+	{
+		{
+			std::lock_guard<std::mutex> lock(m_mtx);
+			m_stop = true;
+		}
+		m_cond.notify_all();
+		if (m_thread.joinable())
+			m_thread.join();
+	}
+
+	std::mutex m_mtx;
+	std::condition_variable m_cond;
+	std::vector<HeapEntry> m_heap;
+	std::atomic<WatchdogSlot*> m_pending { nullptr };
+	bool m_stop = false;
+	std::thread m_thread;
+};
 
 bool vCPU::timed_out() const
 {
@@ -42,11 +274,64 @@ bool vCPU::timed_out() const
 	return false;
 }
 
+void vCPU::arm_lapic_timer(uint64_t now)
+{
+	/* Program the remainder of the timeout */
+	const uint64_t remaining = (lapic_deadline > now) ? lapic_deadline - now : 0;
+	this->program_lapic_timer(std::clamp<uint64_t>(
+		remaining / lapic_timer_ns_per_tick, 1, UINT32_MAX));
+}
+void vCPU::program_lapic_timer(uint32_t count)
+{
+	/* A count of zero stops the one-shot timer. Also acknowledges
+	   any timer interrupt that was taken since the last time. */
+	struct {
+		__u32 nmsrs; /* number of msrs in entries */
+		__u32 pad = 0;
+
+		struct kvm_msr_entry entries[2];
+	} msrs;
+	msrs.nmsrs = 0;
+	if (this->lapic_eoi_pending) {
+		msrs.entries[msrs.nmsrs].index = AMD64_MSR_X2APIC_EOI;
+		msrs.entries[msrs.nmsrs].data  = 0;
+		msrs.nmsrs++;
+	}
+	msrs.entries[msrs.nmsrs].index = AMD64_MSR_X2APIC_TIMER_ICR;
+	msrs.entries[msrs.nmsrs].data  = count;
+	msrs.nmsrs++;
+
+	if (ioctl(this->fd, KVM_SET_MSRS, &msrs) < (int)msrs.nmsrs) {
+		Machine::machine_exception("KVM_SET_MSRS: failed to program local APIC timer");
+	}
+	this->lapic_eoi_pending = false;
+}
+
 void vCPU::run(uint32_t ticks)
 {
 	timer_was_triggered = false;
 	this->timer_ticks = ticks;
-	if (timer_ticks != 0) {
+	if (timer_ticks != 0 && this->use_lapic_timer) {
+		const uint64_t now = ExecutionWatchdog::now();
+		this->lapic_deadline = now + ticks * 1'000'000ULL;
+		this->arm_lapic_timer(now);
+		/* The timer interrupt needs interrupts enabled in the guest */
+		auto& regs = this->registers();
+		if (!(regs.rflags & 0x200)) {
+			regs.rflags |= 0x200;
+			this->set_registers(regs);
+		}
+		if (UNLIKELY(this->watchdog_slot == nullptr))
+			this->watchdog_slot = ExecutionWatchdog::get().create_slot();
+		ExecutionWatchdog::arm(*this->watchdog_slot, this->kvm_run,
+			ticks + LAPIC_WATCHDOG_SLACK_MS);
+	}
+	else if (timer_ticks != 0 && this->use_watchdog) {
+		if (UNLIKELY(this->watchdog_slot == nullptr))
+			this->watchdog_slot = ExecutionWatchdog::get().create_slot();
+		ExecutionWatchdog::arm(*this->watchdog_slot, this->kvm_run, ticks);
+	}
+	else if (timer_ticks != 0) {
 		const struct itimerspec its {
 			/* Interrupt every 20ms after timeout. This makes sure
 			   that we will eventually exit all blocking calls and
@@ -75,6 +360,7 @@ void vCPU::run(uint32_t ticks)
 	try {
 		this->stopped = false;
 		while(run_once());
+		machine().main_memory().check_snapshot_pager();
 	} catch (...) {
 		disable_timer();
 		throw;
@@ -85,7 +371,14 @@ void vCPU::run(uint32_t ticks)
 void vCPU::disable_timer()
 {
 	timer_was_triggered = false;
-	if (timer_ticks != 0) {
+	if (timer_ticks != 0 && this->use_watchdog) {
+		this->timer_ticks = 0;
+		ExecutionWatchdog::disarm(*this->watchdog_slot);
+		/* Don't let the timer fire during the next vmcall */
+		if (this->use_lapic_timer)
+			this->program_lapic_timer(0);
+	}
+	else if (timer_ticks != 0) {
 		this->timer_ticks = 0;
 		struct itimerspec its;
 		__builtin_memset(&its, 0, sizeof(its));
@@ -103,6 +396,7 @@ long vCPU::run_once()
 		ScopedProfiler<MachineProfiling::VCpuRun> prof(machine().profiling());
 		result = ioctl(this->fd, KVM_RUN, 0);
 	}
+	machine().main_memory().check_snapshot_pager();
 	// Handle potential KVM_RUN failure or execution timeout
 	if (UNLIKELY(result < 0)) {
 		if (this->timer_ticks) {
@@ -252,6 +546,7 @@ long vCPU::run_once()
 				ScopedProfiler<MachineProfiling::PageFault> prof(machine().profiling());
 				auto& regs = registers();
 				const uint64_t addr = regs.rdi & ~(uint64_t) 0x8000000000000FFF;
+				const bool write_fault = (regs.rax & 0x2) != 0;
 //#define VERBOSE_PAGE_FAULTS
 #ifdef VERBOSE_PAGE_FAULTS
 				char buffer[256];
@@ -292,6 +587,7 @@ long vCPU::run_once()
 							// Since it's foreign memory, we try to handle it in the remote VM
 							WritablePageOptions zero_opts;
 							zero_opts.zeroes = false;
+							zero_opts.cached = false;
 							(void)writable_page_at(machine().remote().memory, addr, PDE64_USER | PDE64_RW, zero_opts);
 							// Remember that this address caused a fault, so that we don't loop infinitely
 							if (this->last_fault_address == addr) {
@@ -350,6 +646,20 @@ long vCPU::run_once()
 					Machine::machine_exception("Page fault repeat on same address", intr);
 				}
 				this->last_fault_address = addr;
+				/* Writes that continue where the last write fault (and its
+				   fault-ahead) ended will duplicate more pages ahead of time. */
+				if (write_fault && !memory.main_memory_writes && !memory.smp_guards_enabled) {
+					if (addr == this->fault_ahead_next) {
+						this->fault_ahead_pages = std::min(
+							std::max(this->fault_ahead_pages * 2, 1u), MAX_FAULT_AHEAD_PAGES);
+					} else {
+						this->fault_ahead_pages /= 2;
+					}
+					size_t ahead = 0;
+					if (this->fault_ahead_pages != 0)
+						ahead = writable_pages_ahead(memory, addr, this->fault_ahead_pages);
+					this->fault_ahead_next = addr + (ahead + 1) * vMemory::PageSize();
+				}
 				if constexpr (false) {
 					char buffer[256];
 					PRINTER(machine().m_printer, buffer,
@@ -378,6 +688,19 @@ long vCPU::run_once()
 				}
 				return KVM_EXIT_IO;
 			}
+			else if (intr == 33 && this->use_lapic_timer) /* Local APIC timer */
+			{
+				this->lapic_eoi_pending = true;
+				if (this->timer_ticks != 0) {
+					const uint64_t now = ExecutionWatchdog::now();
+					if (now >= this->lapic_deadline) {
+						Machine::timeout_exception("Timeout Exception", this->timer_ticks);
+					}
+					/* Early or stale timer interrupt, re-arm and continue */
+					this->arm_lapic_timer(now);
+				}
+				return KVM_EXIT_IO;
+			}
 			else if (intr == 1) /* Debug trap */
 			{
 				machine().m_on_breakpoint(*this);
@@ -409,6 +732,10 @@ long vCPU::run_once()
 				"Memory write outside physical memory (out of memory?)",
 				addr);
 		}
+	case KVM_EXIT_DIRTY_RING_FULL:
+		/* Move the dirty pages out of the ring, and resume. */
+		machine().main_memory().record_dirty_ring_pages(*this);
+		return KVM_EXIT_DIRTY_RING_FULL;
 	case KVM_EXIT_INTERNAL_ERROR:
 		Machine::machine_exception("KVM internal error");
 	}
@@ -608,8 +935,19 @@ unsigned vCPU::exception_extra_offset(uint8_t intr)
 
 void Machine::migrate_to_this_thread()
 {
-	timer_delete(vcpu.timer_id);
-	vcpu.timer_id = create_vcpu_timer();
+	/* The watchdog looks up the thread each time it is armed */
+	if (vcpu.timer_id != nullptr && vcpu.timer_tid != gettid()) {
+		timer_delete(vcpu.timer_id);
+		vcpu.timer_id = create_vcpu_timer();
+		vcpu.timer_tid = gettid();
+	}
+}
+void vCPU::destroy_watchdog_slot()
+{
+	if (this->watchdog_slot != nullptr) {
+		ExecutionWatchdog::get().destroy_slot(this->watchdog_slot);
+		this->watchdog_slot = nullptr;
+	}
 }
 
 } // tinykvm
@@ -11,6 +11,7 @@ struct VirtualMem {
 	uint64_t remote_end = 0; // End of remote vmem (for remote calls)
 	unsigned bank_idx = 0; // Optional bank index
 	std::string filename; // Optional, for file-backed mappings
+	uint64_t file_offset = 0; // File offset, for file-backed mappings
 
 	VirtualMem(uint64_t phys, char* p, uint64_t s, uint64_t vb = 0, uint64_t r = 0)
 		: physbase(phys), ptr(p), virtbase(vb), size(s), remote_end(r) {}
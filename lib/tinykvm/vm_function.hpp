@@ -0,0 +1,98 @@
+#pragma once
+#include "machine.hpp"
+#include <cstring>
+#include <string>
+#include <string_view>
+#include <type_traits>
+
+namespace tinykvm
+{
+	template <typename F> struct VmFunction;
+
+	/* A guest function with a fixed signature, resolved once. Calls
+	   do no symbol lookups, and argument and return types are checked
+	   at compile time. Forks share the address with their master.
+
+	   VmFunction<long(const char*, ArgumentBuffer)> f { master, "func" };
+	   long result = f(fork, "text", ArgumentBuffer{payload});
+	*/
+	template <typename R, typename... Args>
+	struct VmFunction<R(Args...)>
+	{
+		using address_t = Machine::address_t;
+
+		VmFunction(const Machine& vm, std::string_view symbol, float timeout = 0.f)
+			: m_addr(vm.address_of(symbol)), m_timeout(timeout)
+		{
+			if (m_addr == 0x0)
+				throw MachineException("VmFunction: Symbol not found");
+		}
+		VmFunction(address_t addr, float timeout = 0.f)
+			: m_addr(addr), m_timeout(timeout) {}
+
+		R operator() (Machine& vm, const Args&... args) const {
+			return this->call(vm, m_timeout, args...);
+		}
+		/* Call with a different timeout (0 = no timeout) */
+		R call(Machine& vm, float timeout, const Args&... args) const
+		{
+			auto& regs = vm.registers();
+			vm.setup_call(regs, m_addr, vm.stack_address(), argument(args)...);
+			vm.set_registers(regs);
+			vm.run(timeout);
+			return result(vm);
+		}
+
+		address_t address() const noexcept { return m_addr; }
+		float timeout() const noexcept { return m_timeout; }
+
+	private:
+		template <typename T>
+		static constexpr unsigned registers_used() {
+			return std::is_same_v<T, ArgumentBuffer> ? 2 : 1;
+		}
+		template <typename T>
+		static constexpr bool is_argument() {
+			return std::is_integral_v<T> || std::is_enum_v<T>
+				|| std::is_same_v<T, std::string> || std::is_same_v<T, ArgumentBuffer>
+				|| std::is_same_v<T, const char*> || std::is_same_v<T, char*>;
+		}
+		static_assert((is_argument<Args>() && ...),
+			"VmFunction arguments must be integers, enums, strings or ArgumentBuffer (no floating-point)");
+		static_assert((registers_used<Args>() + ... + 0) <= 6,
+			"VmFunction arguments must fit in six registers");
+		static_assert(std::is_void_v<R> || std::is_integral_v<R> || std::is_enum_v<R>
+			|| std::is_same_v<R, float> || std::is_same_v<R, double>,
+			"VmFunction can only return integers, enums, float and double");
+
+		/* Enums are passed as their underlying type */
+		template <typename T>
+		static decltype(auto) argument(const T& arg) {
+			if constexpr (std::is_enum_v<T>)
+				return static_cast<std::underlying_type_t<T>>(arg);
+			else
+				return (arg);
+		}
+
+		static R result(const Machine& vm)
+		{
+			if constexpr (std::is_void_v<R>) {
+				return;
+			} else if constexpr (std::is_floating_point_v<R>) {
+				/* SYSV returns floating-point values in xmm0 */
+				const auto fpu = vm.fpu_registers();
+				R value;
+				std::memcpy(&value, &fpu.xmm[0][0], sizeof(R));
+				return value;
+			} else if constexpr (std::is_same_v<R, bool>) {
+				return (vm.return_value() & 0xFF) != 0;
+			} else {
+				/* The exit function moves rax to rdi */
+				return static_cast<R>(vm.return_value());
+			}
+		}
+
+		address_t m_addr;
+		float m_timeout;
+	};
+}
@@ -0,0 +1,277 @@
+#include "vm_pool.hpp"
+
+#include <ctime>
+#include <pthread.h>
+#include <sched.h>
+
+namespace tinykvm {
+	static constexpr bool VERBOSE_VM_POOL = false;
+
+static uint64_t time_now_ns()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return uint64_t(ts.tv_sec) * 1'000'000'000ULL + uint64_t(ts.tv_nsec);
+}
+
+VMPool::VMPool(const VMPoolOptions& options)
+	: m_options{options}
+{
+	if (options.num_workers == 0 || options.forks_per_master == 0) {
+		throw MachineException("VM pool needs at least one worker and fork per master");
+	}
+	for (unsigned i = 0; i < options.num_workers; i++) {
+		m_workers.push_back(std::make_unique<Worker>());
+	}
+	for (unsigned i = 0; i < options.num_workers; i++) {
+		m_workers[i]->thread = std::thread(&VMPool::worker_loop, this, i);
+	}
+}
+
+VMPool::~VMPool()
+{
+	for (auto& worker : m_workers) {
+		{
+			std::lock_guard<std::mutex> lock(worker->mtx);
+			worker->stop = true;
+		}
+		worker->cond.notify_one();
+	}
+	for (auto& worker : m_workers) {
+		worker->thread.join();
+	}
+}
+
+unsigned VMPool::forks_per_master() const noexcept
+{
+	return std::min<unsigned>(m_options.forks_per_master, m_workers.size());
+}
+
+void VMPool::submit(const Machine& master, request_t request)
+{
+	std::unique_lock<std::mutex> lock(m_mtx);
+	auto it = m_masters.find(&master);
+	if (it == m_masters.end()) {
+		it = m_masters.emplace(&master, Master{}).first;
+		it->second.first_worker = m_next_worker;
+		m_next_worker = (m_next_worker + 1) % m_workers.size();
+	}
+	it->second.last_used = ++m_clock;
+	const unsigned first = it->second.first_worker;
+	lock.unlock();
+
+	/* Pick the least busy of the workers assigned to the master */
+	Worker* best = nullptr;
+	unsigned best_pending = ~0u;
+	for (unsigned i = 0; i < forks_per_master(); i++) {
+		auto& worker = *m_workers[(first + i) % m_workers.size()];
+		const unsigned pending = worker.pending.load(std::memory_order_relaxed);
+		if (pending < best_pending) {
+			best = &worker;
+			best_pending = pending;
+		}
+	}
+	this->push(*best, Task{ .master = &master, .request = std::move(request), .done = nullptr }, false);
+}
+
+void VMPool::push(Worker& worker, Task task, bool urgent)
+{
+	worker.pending.fetch_add(1, std::memory_order_relaxed);
+	{
+		std::lock_guard<std::mutex> lock(worker.mtx);
+		if (urgent)
+			worker.tasks.push_front(std::move(task));
+		else
+			worker.tasks.push_back(std::move(task));
+	}
+	worker.cond.notify_one();
+}
+
+void VMPool::worker_loop(unsigned idx)
+{
+	auto& worker = *m_workers[idx];
+	if (m_options.pin_workers) {
+		const unsigned cpus = std::max(1u, std::thread::hardware_concurrency());
+		cpu_set_t set;
+		CPU_ZERO(&set);
+		CPU_SET(idx % cpus, &set);
+		pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+	}
+
+	while (true)
+	{
+		Task task;
+		{
+			std::unique_lock<std::mutex> lock(worker.mtx);
+			worker.cond.wait(lock, [&] { return worker.stop || !worker.tasks.empty(); });
+			if (worker.tasks.empty())
+				break;
+			task = std::move(worker.tasks.front());
+			worker.tasks.pop_front();
+		}
+		if (task.request)
+			this->run_request(worker, task);
+		else
+			this->evict(worker, task.master);
+		if (task.done)
+			task.done();
+		worker.pending.fetch_sub(1, std::memory_order_relaxed);
+	}
+	/* Forks are destroyed on the thread that created them */
+	worker.forks.clear();
+}
+
+void VMPool::run_request(Worker& worker, Task& task)
+{
+	auto& fork = worker.forks[task.master];
+	if (fork.vm != nullptr && fork.vm->has_background_reset()) {
+		this->finish_reset(task.master, fork);
+	}
+	if (fork.vm == nullptr) {
+		try {
+			fork.vm.reset(new Machine{*task.master, m_options.fork_options});
+		} catch (...) {
+			worker.forks.erase(task.master);
+			task.request(nullptr, std::current_exception());
+			return;
+		}
+	}
+	task.request(fork.vm.get(), nullptr);
+
+	/* Reset the fork for the next request, after the response */
+	const uint64_t t0 = time_now_ns();
+	if (m_options.background_reset) {
+		fork.vm->reset_to_in_background(*task.master, m_options.fork_options);
+		m_reset_nanos.fetch_add(time_now_ns() - t0, std::memory_order_relaxed);
+		return;
+	}
+	size_t bytes = 0;
+	try {
+		fork.vm->reset_to(*task.master, m_options.fork_options);
+		bytes = fork.vm->banked_memory_bytes();
+	} catch (...) {
+		/* Create a new fork for the next request instead */
+		fork.vm = nullptr;
+	}
+	m_reset_nanos.fetch_add(time_now_ns() - t0, std::memory_order_relaxed);
+	m_resets.fetch_add(1, std::memory_order_relaxed);
+	this->account(task.master, fork, bytes);
+	if (fork.vm == nullptr)
+		worker.forks.erase(task.master);
+}
+
+void VMPool::finish_reset(const Machine* master, Fork& fork)
+{
+	const uint64_t t0 = time_now_ns();
+	size_t bytes = 0;
+	try {
+		fork.vm->wait_for_reset();
+		bytes = fork.vm->banked_memory_bytes();
+	} catch (...) {
+		/* Create a new fork for this request instead */
+		fork.vm = nullptr;
+	}
+	m_reset_nanos.fetch_add(time_now_ns() - t0, std::memory_order_relaxed);
+	m_resets.fetch_add(1, std::memory_order_relaxed);
+	this->account(master, fork, bytes);
+}
+
+void VMPool::evict(Worker& worker, const Machine* master)
+{
+	auto it = worker.forks.find(master);
+	if (it != worker.forks.end()) {
+		this->account(master, it->second, 0);
+		worker.forks.erase(it);
+	}
+
+	std::lock_guard<std::mutex> lock(m_mtx);
+	auto mit = m_masters.find(master);
+	if (mit != m_masters.end() && mit->second.evictions_pending > 0)
+		mit->second.evictions_pending--;
+}
+
+void VMPool::account(const Machine* master, Fork& fork, size_t bytes)
+{
+	std::unique_lock<std::mutex> lock(m_mtx);
+	auto& entry = m_masters[master];
+	m_usage = m_usage - fork.bytes + bytes;
+	entry.bytes = entry.bytes - fork.bytes + bytes;
+	fork.bytes = bytes;
+
+	if (m_options.memory_budget == 0 || m_usage <= m_options.memory_budget)
+		return;
+	/* Evict the forks of the least recently used master, other than
+	   the one that was just used, unless it is being evicted already. */
+	const Machine* victim = nullptr;
+	Master* victim_entry = nullptr;
+	for (auto& [m, e] : m_masters) {
+		if (m == master || e.bytes == 0 || e.evictions_pending > 0)
+			continue;
+		if (victim_entry == nullptr || e.last_used < victim_entry->last_used) {
+			victim = m;
+			victim_entry = &e;
+		}
+	}
+	if (victim == nullptr)
+		return;
+	victim_entry->evictions_pending += forks_per_master();
+	const unsigned first = victim_entry->first_worker;
+	m_evictions++;
+	lock.unlock();
+
+	if constexpr (VERBOSE_VM_POOL) {
+		printf("VM pool: evicting forks of master %p\n", victim);
+	}
+	for (unsigned i = 0; i < forks_per_master(); i++) {
+		auto& worker = *m_workers[(first + i) % m_workers.size()];
+		this->push(worker, Task{ .master = victim, .request = nullptr, .done = nullptr }, true);
+	}
+}
+
+void VMPool::remove_master(const Machine& master)
+{
+	std::unique_lock<std::mutex> lock(m_mtx);
+	auto it = m_masters.find(&master);
+	if (it == m_masters.end())
+		return;
+	const unsigned first = it->second.first_worker;
+	it->second.evictions_pending += forks_per_master();
+	lock.unlock();
+
+	std::vector<std::future<void>> evicted;
+	for (unsigned i = 0; i < forks_per_master(); i++) {
+		auto done = std::make_shared<std::promise<void>>();
+		evicted.push_back(done->get_future());
+		auto& worker = *m_workers[(first + i) % m_workers.size()];
+		this->push(worker, Task{
+			.master = &master,
+			.request = nullptr,
+			.done = [done] { done->set_value(); }
+		}, false);
+	}
+	for (auto& f : evicted)
+		f.get();
+
+	lock.lock();
+	m_masters.erase(&master);
+}
+
+size_t VMPool::memory_usage() const
+{
+	std::lock_guard<std::mutex> lock(m_mtx);
+	return m_usage;
+}
+size_t VMPool::evictions() const
+{
+	std::lock_guard<std::mutex> lock(m_mtx);
+	return m_evictions;
+}
+uint64_t VMPool::reset_time() const
+{
+	const uint64_t resets = m_resets.load(std::memory_order_relaxed);
+	if (resets == 0)
+		return 0;
+	return m_reset_nanos.load(std::memory_order_relaxed) / resets;
+}
+
+} // tinykvm
@@ -0,0 +1,142 @@
+#pragma once
+#include "machine.hpp"
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <exception>
+#include <functional>
+#include <future>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+namespace tinykvm
+{
+	struct VMPoolOptions
+	{
+		/* The number of worker threads. Each worker owns the forks
+		   that it runs requests on, and forks never leave it. */
+		unsigned num_workers = 1;
+		/* The number of forks kept per master, each on a different
+		   worker, so that a master can serve this many requests
+		   at the same time. */
+		unsigned forks_per_master = 1;
+		/* When enabled, worker N is pinned to CPU N (modulo CPUs). */
+		bool pin_workers = true;
+		/* When non-zero, the forks of the least recently used masters
+		   are evicted while the working memory of all forks, as seen
+		   by banked_memory_bytes() after each reset, exceeds this. */
+		size_t memory_budget = 0;
+		/* When enabled, forks are reset on a helper thread after each
+		   request, so that the worker can move on to the next request
+		   right away. The fork is waited for when it is next used. */
+		bool background_reset = false;
+		/* The options used to create and to reset forks. */
+		MachineOptions fork_options;
+	};
+
+	struct VMPool
+	{
+		/* Run a request on a fork of the given master, on one of the
+		   workers assigned to the master. The fork is reset after the
+		   request completes, before its worker takes the next request.
+		   The master must be forkable, and must be removed from the pool
+		   with remove_master() before it is destroyed. */
+		template <typename F>
+		auto enqueue(const Machine& master, F&& func)
+			-> std::future<std::invoke_result_t<F&, Machine&>>;
+
+		/* Evict every fork of a master, and wait until they are gone. */
+		void remove_master(const Machine& master);
+
+		/* The working memory of all forks, as of their last reset. */
+		size_t memory_usage() const;
+		/* The number of times a master had its forks evicted. */
+		size_t evictions() const;
+		/* The average time workers spent on resetting a fork, in
+		   nanoseconds. With background_reset, that is starting the
+		   reset and waiting for it when the fork is next used. */
+		uint64_t reset_time() const;
+		unsigned num_workers() const noexcept { return m_workers.size(); }
+
+		VMPool(const VMPoolOptions& options);
+		~VMPool();
+
+	private:
+		using request_t = std::function<void(Machine*, std::exception_ptr)>;
+		struct Task {
+			const Machine* master = nullptr;
+			request_t request; /* Evicts the masters fork when empty */
+			std::function<void()> done;
+		};
+		struct Fork {
+			std::unique_ptr<Machine> vm;
+			size_t bytes = 0;
+		};
+		struct Worker {
+			std::thread thread;
+			std::mutex mtx;
+			std::condition_variable cond;
+			std::deque<Task> tasks;
+			std::atomic<unsigned> pending { 0 };
+			bool stop = false;
+			/* Only accessed from the worker thread */
+			std::unordered_map<const Machine*, Fork> forks;
+		};
+		struct Master {
+			uint64_t last_used = 0;
+			size_t bytes = 0;
+			unsigned first_worker = 0;
+			unsigned evictions_pending = 0;
+		};
+
+		void submit(const Machine& master, request_t);
+		void push(Worker&, Task, bool urgent);
+		void worker_loop(unsigned idx);
+		void run_request(Worker&, Task&);
+		void finish_reset(const Machine* master, Fork&);
+		void evict(Worker&, const Machine* master);
+		void account(const Machine* master, Fork&, size_t bytes);
+		unsigned forks_per_master() const noexcept;
+
+		const VMPoolOptions m_options;
+		std::vector<std::unique_ptr<Worker>> m_workers;
+		mutable std::mutex m_mtx;
+		std::unordered_map<const Machine*, Master> m_masters;
+		uint64_t m_clock = 0;
+		unsigned m_next_worker = 0;
+		size_t m_usage = 0;
+		size_t m_evictions = 0;
+		std::atomic<uint64_t> m_reset_nanos { 0 };
+		std::atomic<uint64_t> m_resets { 0 };
+	};
+
+	template <typename F> inline
+	auto VMPool::enqueue(const Machine& master, F&& func)
+		-> std::future<std::invoke_result_t<F&, Machine&>>
+	{
+		using R = std::invoke_result_t<F&, Machine&>;
+		auto promise = std::make_shared<std::promise<R>>();
+		auto future = promise->get_future();
+		this->submit(master,
+			[promise, func = std::forward<F>(func)] (Machine* vm, std::exception_ptr err) mutable {
+				if (err) {
+					promise->set_exception(err);
+					return;
+				}
+				try {
+					if constexpr (std::is_void_v<R>) {
+						func(*vm);
+						promise->set_value();
+					} else {
+						promise->set_value(func(*vm));
+					}
+				} catch (...) {
+					promise->set_exception(std::current_exception());
+				}
+			});
+		return future;
+	}
+}
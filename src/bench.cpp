@@ -2,6 +2,7 @@
 #include <cstring>
 #include <cstdio>
 #include <cassert>
+#include <fcntl.h>
 #include <sys/mman.h>
 #include <sys/types.h>
 #include <unistd.h>
@@ -23,6 +24,8 @@ inline long nanodiff(timespec start_time, timespec end_time);
 static long micro_benchmark(std::function<void()>);
 static void benchmark_alternate_tenant_vmcalls(tinykvm::Machine &, size_t);
 static void benchmark_alternate_tenant_resets(tinykvm::Machine &, size_t);
+static void benchmark_warm_set_first_request(size_t);
+static void benchmark_snapshot_first_response(size_t);
 static void benchmark_multiple_vms(tinykvm::Machine&, size_t, size_t);
 static void benchmark_multiple_pooled_vms(tinykvm::Machine&, size_t, size_t);
 static std::vector<uint8_t> binary;
@@ -343,6 +346,67 @@ int main(int argc, char** argv)
 		bench_vmexit_time = nanodiff(ft0, ft1);
 	}
 
+	/* Fork + vmcall + destructor, with VMs and vCPUs from a pool */
+	uint64_t pooled_forktime = 0;
+	{
+		auto pooled_options = options;
+		pooled_options.vcpu_pool_size = 1;
+		{
+			tinykvm::Machine vm {master_vm, pooled_options};
+		}
+		for (unsigned i = 0; i < NUM_GUESTS; i++)
+		{
+			asm("" : : : "memory");
+			auto ft0 = time_now();
+			asm("" : : : "memory");
+			{
+				tinykvm::Machine vm {master_vm, pooled_options};
+				vm.vmcall(vmcall_address);
+			}
+			asm("" : : : "memory");
+			auto ft1 = time_now();
+			pooled_forktime += nanodiff(ft0, ft1);
+		}
+	}
+
+	/* Timed vmcalls using the execution watchdog */
+	uint64_t watchdog_calltime = 0;
+	{
+		auto watchdog_options = options;
+		watchdog_options.watchdog_timeouts = true;
+		tinykvm::Machine wvm {master_vm, watchdog_options};
+		wvm.timed_vmcall(vmcall_address, 1.0f);
+		for (unsigned i = 0; i < NUM_GUESTS; i++)
+		{
+			asm("" : : : "memory");
+			auto ft0 = time_now();
+			asm("" : : : "memory");
+			wvm.timed_vmcall(vmcall_address, 1.0f);
+			asm("" : : : "memory");
+			auto ft1 = time_now();
+			watchdog_calltime += nanodiff(ft0, ft1);
+		}
+	}
+
+	/* Timed vmcalls using the local APIC timer */
+	uint64_t lapic_calltime = 0;
+	{
+		auto lapic_options = options;
+		lapic_options.lapic_timeouts = true;
+		tinykvm::Machine lvm {master_vm, lapic_options};
+		lvm.timed_vmcall(vmcall_address, 1.0f);
+		for (unsigned i = 0; i < NUM_GUESTS; i++)
+		{
+			asm("" : : : "memory");
+			auto ft0 = time_now();
+			asm("" : : : "memory");
+			lvm.timed_vmcall(vmcall_address, 1.0f);
+			asm("" : : : "memory");
+			auto ft1 = time_now();
+			lapic_calltime += nanodiff(ft0, ft1);
+		}
+	}
+
 
 	/* Benchmark the fork reset feature */
 	printf("Benchmarking fast reset...\n");
@@ -384,9 +448,15 @@ int main(int argc, char** argv)
 		calltime / NUM_GUESTS, calltime / NUM_GUESTS / 1000);
 	printf("timed_vmcall: %ldns (%ld micros)\n",
 		timed_calltime / NUM_GUESTS, timed_calltime / NUM_GUESTS / 1000);
+	printf("timed_vmcall (watchdog): %ldns (%ld micros)\n",
+		watchdog_calltime / NUM_GUESTS, watchdog_calltime / NUM_GUESTS / 1000);
+	printf("timed_vmcall (LAPIC timer): %ldns (%ld micros)\n",
+		lapic_calltime / NUM_GUESTS, lapic_calltime / NUM_GUESTS / 1000);
 	printf("vmcall + destructor: %ldns (%ld micros)\n",
 		nanos_per_fc - nanos_per_gf, (nanos_per_fc - nanos_per_gf) / 1000);
 	printf("VM fork totals: %ldns (%ld micros)\n", nanos_per_fc, nanos_per_fc / 1000);
+	printf("Pooled VM fork totals: %ldns (%ld micros)\n",
+		pooled_forktime / NUM_GUESTS, pooled_forktime / NUM_GUESTS / 1000);
 
 	auto nanos_per_vmexit = bench_vmexit_time / NUM_VMEXITS;
 	printf("VM vmexit time: %ldns (%ld micros)\n", nanos_per_vmexit, nanos_per_vmexit / 1000);
@@ -401,6 +471,14 @@ int main(int argc, char** argv)
 	// which is supported, but has a serious penalty on Linux.
 	benchmark_alternate_tenant_resets(master_vm, 5000);
 
+	// Benchmark the first request in new forks, with and
+	// without pre-populating the warm set of the master VM
+	benchmark_warm_set_first_request(500);
+
+	// Benchmark the first response from a VM loaded from a snapshot
+	// that is not in the page cache, with and without prefetching
+	benchmark_snapshot_first_response(20);
+
 	// Benchmark calling many forked VMs on same thread
 	// Seems to be fine, which I guess means that the penalty
 	// has to do with costs attached to main memory switching.
@@ -545,6 +623,131 @@ void benchmark_alternate_tenant_resets(tinykvm::Machine& master_vm, const size_t
 	printf("Alternating reset: vmcall: %ldns (%ld micros)\n", frcall, frcall / 1000);
 }
 
+void benchmark_warm_set_first_request(const size_t FORKS)
+{
+	// The warm set belongs to the master VM, so use a separate one
+	tinykvm::Machine master_vm { binary,
+	{
+		.max_mem = GUEST_MEMORY,
+		.max_cow_mem = 0
+	} };
+	master_vm.setup_linux(
+		{"kvmtest", "Hello World!\n"},
+		{"LC_TYPE=C", "LC_ALL=C", "USER=root"});
+	master_vm.run();
+	master_vm.prepare_copy_on_write();
+
+	const uint64_t vmcall_address = master_vm.address_of("bench");
+	const tinykvm::MachineOptions options {
+		.max_mem = GUEST_MEMORY,
+		.max_cow_mem = GUEST_COW_MEM,
+	};
+
+	auto first_request = [&] (uint64_t& forktime, uint64_t& calltime)
+	{
+		forktime = 0;
+		calltime = 0;
+		for (unsigned i = 0; i < FORKS; i++)
+		{
+			auto frt0 = time_now();
+			asm("" : : : "memory");
+			tinykvm::Machine fvm {master_vm, options};
+			asm("" : : : "memory");
+			auto frt1 = time_now();
+			asm("" : : : "memory");
+			fvm.timed_vmcall(vmcall_address, 4.0f);
+			asm("" : : : "memory");
+			auto frt2 = time_now();
+			forktime += nanodiff(frt0, frt1);
+			calltime += nanodiff(frt1, frt2);
+		}
+		forktime /= FORKS;
+		calltime /= FORKS;
+	};
+
+	uint64_t cold_fork, cold_call;
+	first_request(cold_fork, cold_call);
+
+	// Record the warm set from a training request
+	{
+		tinykvm::Machine training {master_vm, options};
+		training.timed_vmcall(vmcall_address, 4.0f);
+		master_vm.set_warm_set(training.get_accessed_pages());
+	}
+
+	uint64_t warm_fork, warm_call;
+	first_request(warm_fork, warm_call);
+
+	printf("Warm set: %zu pages\n", master_vm.warm_set_pages());
+	printf("First request (cold): fork %ldns vmcall %ldns (%ld micros)\n",
+		cold_fork, cold_call, (cold_fork + cold_call) / 1000);
+	printf("First request (warm): fork %ldns vmcall %ldns (%ld micros)\n",
+		warm_fork, warm_call, (warm_fork + warm_call) / 1000);
+}
+
+void benchmark_snapshot_first_response(const size_t LOADS)
+{
+	const std::string snapshot = "/tmp/tinykvm_bench_snapshot.bin";
+	unlink(snapshot.c_str());
+	{
+		tinykvm::Machine vm { binary, {
+			.max_mem = GUEST_MEMORY,
+			.snapshot_file = snapshot,
+			.snapshot_mode = tinykvm::MachineOptions::SnapshotMode::Create,
+		} };
+		vm.setup_linux(
+			{"kvmtest", "Hello World!\n"},
+			{"LC_TYPE=C", "LC_ALL=C", "USER=root"});
+		vm.run();
+		// Record the pages used by main() and one request
+		vm.timed_vmcall(vm.address_of("bench"), 4.0f);
+		vm.save_snapshot_state_now(vm.get_accessed_pages());
+	}
+
+	auto first_response = [&] (bool prefetch, uint64_t& loadtime, uint64_t& calltime)
+	{
+		loadtime = 0;
+		calltime = 0;
+		for (unsigned i = 0; i < LOADS; i++)
+		{
+			// Evict the snapshot from the page cache, like after a reboot
+			const int fd = open(snapshot.c_str(), O_RDONLY);
+			posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+			close(fd);
+
+			auto frt0 = time_now();
+			asm("" : : : "memory");
+			tinykvm::Machine vm { binary, {
+				.max_mem = GUEST_MEMORY,
+				.snapshot_file = snapshot,
+				.snapshot_mode = tinykvm::MachineOptions::SnapshotMode::Open,
+				.snapshot_prefetch = prefetch,
+			} };
+			asm("" : : : "memory");
+			auto frt1 = time_now();
+			asm("" : : : "memory");
+			vm.timed_vmcall(vm.address_of("bench"), 4.0f);
+			asm("" : : : "memory");
+			auto frt2 = time_now();
+			loadtime += nanodiff(frt0, frt1);
+			calltime += nanodiff(frt1, frt2);
+		}
+		loadtime /= LOADS;
+		calltime /= LOADS;
+	};
+
+	uint64_t cold_load, cold_call;
+	first_response(false, cold_load, cold_call);
+	uint64_t prefetch_load, prefetch_call;
+	first_response(true, prefetch_load, prefetch_call);
+	unlink(snapshot.c_str());
+
+	printf("Snapshot first response: load %ldns vmcall %ldns (%ld micros)\n",
+		cold_load, cold_call, (cold_load + cold_call) / 1000);
+	printf("Snapshot first response (prefetch): load %ldns vmcall %ldns (%ld micros)\n",
+		prefetch_load, prefetch_call, (prefetch_load + prefetch_call) / 1000);
+}
+
 void benchmark_multiple_vms(tinykvm::Machine& master_vm, size_t NUM, size_t RESETS)
 {
 	const uint64_t vmcall_address = master_vm.address_of("bench");
@@ -595,87 +798,50 @@ void benchmark_multiple_vms(tinykvm::Machine& master_vm, size_t NUM, size_t RESE
 	printf("Multiple %zuxVMs vmcall: %ldns (%ld micros)\n", NUM, frcall, frcall / 1000);
 }
 
-#include <tinykvm/util/threadpool.h>
-extern "C" int gettid();
+#include <tinykvm/vm_pool.hpp>
 
 void benchmark_multiple_pooled_vms(tinykvm::Machine& master_vm, size_t NUM, size_t RESETS)
 {
-	tinykvm::ThreadPool pool { NUM, 0, false };
-	std::unordered_map<int, tinykvm::Machine> machines;
-	std::mutex machine_mtx;
-
-	struct {
-		std::unordered_map<int, tinykvm::Machine>* machines;
-		std::mutex* mtx;
-		tinykvm::Machine* master_vm;
-		uint64_t addr;
-	} data {&machines, &machine_mtx, &master_vm, master_vm.address_of("bench")};
-
-	// A single pool task that can be run on any thread
-	auto task =
-	[&data] () -> std::tuple<timespec, timespec, timespec>
-	{
-		int tid = gettid();
-		thread_local tinykvm::Machine* fvm = nullptr;
-
-		const tinykvm::MachineOptions options {
+	/* One fork of the master per worker. A full reset happens on the
+	   worker after each request, otherwise the fork is reset in the
+	   background and the worker only waits for what is left of it. */
+	tinykvm::VMPool pool {{
+		.num_workers = unsigned(NUM),
+		.forks_per_master = unsigned(NUM),
+		.background_reset = !FULL_RESET,
+		.fork_options = {
 			.max_mem = GUEST_MEMORY,
 			.max_cow_mem = GUEST_COW_MEM,
 			.reset_free_work_mem = 128UL * 1024 * 1024,
-		};
-
-		if (fvm == nullptr) {
-			data.mtx->lock();
-			auto it = data.machines->find(tid);
-			if (it == data.machines->end()) {
-				auto it = data.machines->emplace(std::piecewise_construct,
-					std::forward_as_tuple(tid),
-					std::forward_as_tuple(*data.master_vm, options));
-				fvm = &it.first->second;
-			} else {
-				fvm = &it->second;
-			}
-			data.mtx->unlock();
-		}
-
-		asm("" : : : "memory");
-		auto frt0 = time_now();
-		asm("" : : : "memory");
-		if constexpr (FULL_RESET) {
-			fvm->reset_to(*data.master_vm, options);
-		}
-		asm("" : : : "memory");
-		auto frt1 = time_now();
-		asm("" : : : "memory");
-		if constexpr (FULL_RESET) {
-			fvm->timed_vmcall(data.addr, 4.0f);
-		} else {
-			fvm->timed_vmcall(data.addr, 4.0f);
-		}
-		asm("" : : : "memory");
-		auto frt2 = time_now();
-		return {frt0, frt1, frt2};
-	};
+		},
+	}};
+	const uint64_t addr = master_vm.address_of("bench");
 
 	// Perform pool benchmark
-	std::vector<std::future<std::tuple<timespec, timespec, timespec>>> results;
+	std::vector<std::future<long>> results;
 	results.reserve(RESETS);
 
 	for (unsigned i = 0; i < RESETS; i++)
 	{
-		results.emplace_back(pool.enqueue(task));
+		results.emplace_back(pool.enqueue(master_vm, [addr] (tinykvm::Machine& vm) {
+			asm("" : : : "memory");
+			auto frt0 = time_now();
+			asm("" : : : "memory");
+			vm.timed_vmcall(addr, 4.0f);
+			asm("" : : : "memory");
+			auto frt1 = time_now();
+			return nanodiff(frt0, frt1);
+		}));
 	}
 
 	// Gather results
-	uint64_t frtime = 0;
 	uint64_t frcall = 0;
 	for (auto& fut : results) {
-		auto [frt0, frt1, frt2] = fut.get();
-		frtime += nanodiff(frt0, frt1);
-		frcall += nanodiff(frt1, frt2);
+		frcall += fut.get();
 	}
-	frtime /= results.size();
 	frcall /= results.size();
+	const uint64_t frtime = pool.reset_time();
+	pool.remove_master(master_vm);
 
 	printf("Pooled %zuxVMs reset: %ldns (%ld micros)\n", NUM, frtime, frtime / 1000);
 	printf("Pooled %zuxVMs vmcall: %ldns (%ld micros)\n", NUM, frcall, frcall / 1000);
@@ -111,6 +111,7 @@ int main(int argc, char** argv)
 		.hugepages = (getenv("HUGE") != nullptr),
 		.relocate_fixed_mmap = (getenv("GO") == nullptr),
 		.executable_heap = dyn_elf.is_dynamic,
+		.hugepage_working_memory = (getenv("HUGEWORK") != nullptr),
 	};
 	tinykvm::Machine master_vm {binary, options};
 	//master_vm.print_pagetables();
@@ -1,6 +1,7 @@
 #include <catch2/catch_test_macros.hpp>
 
 #include <tinykvm/machine.hpp>
+#include <tinykvm/vm_function.hpp>
 extern std::vector<uint8_t> build_and_load(const std::string& code);
 static const uint64_t MAX_MEMORY = 8ul << 20; /* 8MB */
 static const std::vector<std::string> env {
@@ -116,3 +117,45 @@ int main() {
 
 	REQUIRE(machine.return_value() == 0);
 }
+
+TEST_CASE("Typed vmcalls with VmFunction", "[Output]")
+{
+	const auto binary = build_and_load(R"M(
+int main() {
+}
+extern long add(long a, int b) {
+	return a + b;
+}
+extern long measure(const char* str, const char* data, unsigned long len) {
+	long n = 0;
+	while (str[n] != 0) n++;
+	return n * 1000 + len + data[len - 1];
+}
+extern double half(long x) {
+	return x / 2.0;
+}
+extern int is_odd(int x) {
+	return x & 1;
+})M");
+
+	tinykvm::Machine machine { binary, { .max_mem = MAX_MEMORY } };
+	machine.setup_linux({"vmfunction"}, env);
+	machine.run(4.0f);
+
+	tinykvm::VmFunction<long(long, int)> add { machine, "add", 4.0f };
+	tinykvm::VmFunction<long(std::string, tinykvm::ArgumentBuffer)> measure { machine, "measure", 4.0f };
+	tinykvm::VmFunction<double(long)> half { machine, "half", 4.0f };
+	tinykvm::VmFunction<bool(int)> is_odd { machine, "is_odd", 4.0f };
+	REQUIRE(add.address() == machine.address_of("add"));
+
+	for (int i = 0; i < 10; i++) {
+		REQUIRE(add(machine, 1000, i) == 1000 + i);
+		REQUIRE(measure(machine, "Hello", tinykvm::ArgumentBuffer{"ab\x05", 3}) == 5003 + 5);
+		REQUIRE(half(machine, 2 * i + 1) == i + 0.5);
+		REQUIRE(is_odd(machine, i) == bool(i & 1));
+	}
+
+	REQUIRE_THROWS([&] {
+		tinykvm::VmFunction<void()> missing { machine, "does_not_exist" };
+	}());
+}
@@ -1,8 +1,12 @@
 #include <catch2/catch_test_macros.hpp>
+#include <fcntl.h>
+#include <unistd.h>
 
 #include <tinykvm/machine.hpp>
 #include <tinykvm/rsp_client.hpp>
 extern std::vector<uint8_t> load_file(const std::string& filename);
+extern std::vector<uint8_t> build_and_load(const std::string& code);
+extern std::pair<std::string, std::vector<uint8_t>> build_and_load(const std::string& code, const std::string& args);
 static const uint64_t MAX_MEMORY = 8ul << 20; /* 8MB */
 static const std::vector<std::string> env{
 	"LC_TYPE=C", "LC_ALL=C", "USER=root"};
@@ -14,6 +18,75 @@ TEST_CASE("Initialize KVM", "[Initialize]")
 	tinykvm::Machine::init();
 }
 
+TEST_CASE("Symbol lookups", "[ELF]")
+{
+	const auto binary = build_and_load(R"M(
+int main() {
+}
+extern long first_function(long x) {
+	return x + 1;
+}
+extern long second_function(long x) {
+	return x * 2;
+})M");
+
+	tinykvm::Machine machine { binary, { .max_mem = MAX_MEMORY } };
+	const auto first = machine.address_of("first_function");
+	const auto second = machine.address_of("second_function");
+	REQUIRE(first != 0x0);
+	REQUIRE(second != 0x0);
+	REQUIRE(first != second);
+	REQUIRE(machine.address_of("does_not_exist") == 0x0);
+	// Lookups without an index agree with the index
+	REQUIRE(tinykvm::Machine::AddressOf("first_function",
+		{(const char*)binary.data(), binary.size()}) == first);
+	// Names are not required to be zero-terminated
+	REQUIRE(machine.address_of(std::string_view("first_functionXYZ", 14)) == first);
+
+	REQUIRE(machine.resolve(first) == "first_function + 0x0");
+	REQUIRE(machine.resolve(second + 1) == "second_function + 0x1");
+
+	// Stripped shared objects are looked up through .gnu.hash
+	tinykvm::Machine ld { ld_linux_x86_64_so, { .max_mem = MAX_MEMORY } };
+	const auto tls = ld.address_of("_dl_allocate_tls");
+	REQUIRE(tls > ld.image_base());
+	REQUIRE(ld.resolve(tls) == "_dl_allocate_tls + 0x0");
+}
+
+TEST_CASE("Load ELF segments mapped from the file", "[ELF]")
+{
+	const auto [filename, binary] = build_and_load(R"M(
+static const char text[8192] = "Hello from a read-only segment";
+static long counter = 1000;
+static char zeroes[65536];
+int main() {
+}
+extern long check() {
+	long sum = 0;
+	for (unsigned i = 0; i < sizeof(zeroes); i++)
+		sum += zeroes[i];
+	zeroes[100] = 1;
+	return sum + text[0] + (counter++);
+})M", "");
+
+	const int fd = open(filename.c_str(), O_RDONLY);
+	REQUIRE(fd >= 0);
+	tinykvm::Machine machine { binary, {
+		.max_mem = MAX_MEMORY,
+		.binary_fd = fd,
+	} };
+	close(fd);
+	machine.setup_linux({"mapped"}, env);
+	machine.run(4.0f);
+
+	const auto check = machine.address_of("check");
+	REQUIRE(check != 0x0);
+	for (long i = 0; i < 4; i++) {
+		machine.timed_vmcall(check, 4.0f);
+		REQUIRE(machine.return_value() == 'H' + 1000 + i + (i > 0 ? 1 : 0));
+	}
+}
+
 TEST_CASE("Verify dynamic Rust ELF", "[ELF]")
 {
 	std::string guest_filename
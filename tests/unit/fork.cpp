@@ -349,6 +349,239 @@ extern int get_value() {
 	}
 }
 
+TEST_CASE("Fork with dirty ring resets", "[Fork]")
+{
+	const auto binary = build_and_load(R"M(
+#include <string.h>
+int main() {
+}
+
+static int value = 0;
+static char buffer[1024 * 1024];
+extern int get_value(int touch) {
+	if (touch)
+		memset(buffer, touch, sizeof(buffer));
+	value ++;
+	return value + buffer[touch * 4096];
+})M");
+
+	tinykvm::Machine machine { binary, { .max_mem = MAX_MEMORY,
+		.split_hugepages = true
+	 } };
+	machine.setup_linux({"fork"}, env);
+	machine.run(4.0f);
+	machine.prepare_copy_on_write();
+
+	const tinykvm::MachineOptions options {
+		.max_mem = MAX_MEMORY,
+		.max_cow_mem = MAX_COWMEM,
+		.split_hugepages = true,
+		.reset_keep_all_work_memory = true,
+		.reset_dirty_ring_entries = 256,
+	};
+	auto fork = tinykvm::Machine { machine, options };
+	REQUIRE(fork.has_dirty_ring());
+
+	auto funcaddr = machine.address_of("get_value");
+	REQUIRE(funcaddr != 0x0);
+
+	for (int i = 0; i < 50; i++) {
+		// Alternate between dirtying many pages and only a few,
+		// which also forces the dirty ring to fill up
+		const int touch = (i % 2 == 0) ? 1 : 0;
+		fork.timed_vmcall(funcaddr, 4.0f, touch);
+		REQUIRE(fork.return_value() == 1 + touch);
+
+		fork.reset_to(machine, options);
+	}
+	// The guest writes must have been seen through the ring
+	REQUIRE(fork.dirty_ring_harvested() > 0);
+}
+
+TEST_CASE("Fork with hugepage merging resets", "[Fork]")
+{
+	const auto binary = build_and_load(R"M(
+#include <string.h>
+int main() {
+}
+
+static int value = 0;
+static char buffer[2 * 1024 * 1024] __attribute__((aligned(2 * 1024 * 1024)));
+extern int get_value(int touch) {
+	if (touch)
+		memset(buffer, touch, sizeof(buffer));
+	value ++;
+	return value + buffer[touch * 4096];
+})M");
+
+	tinykvm::Machine machine { binary, { .max_mem = 2 * MAX_MEMORY,
+		.split_hugepages = true
+	 } };
+	machine.setup_linux({"fork"}, env);
+	machine.run(4.0f);
+	machine.prepare_copy_on_write();
+
+	const tinykvm::MachineOptions options {
+		.max_mem = 2 * MAX_MEMORY,
+		.max_cow_mem = 8ul << 20,
+		.split_hugepages = true,
+		.reset_keep_all_work_memory = true,
+		.reset_merge_hugepages_interval = 4,
+	};
+	auto fork = tinykvm::Machine { machine, options };
+
+	auto funcaddr = machine.address_of("get_value");
+	REQUIRE(funcaddr != 0x0);
+
+	for (int i = 0; i < 20; i++) {
+		const int touch = (i % 3 == 0) ? 1 : 0;
+		fork.timed_vmcall(funcaddr, 4.0f, touch);
+		REQUIRE(fork.return_value() == 1 + touch);
+
+		fork.reset_to(machine, options);
+	}
+	// The whole buffer was privatized, so it should have been merged
+	REQUIRE(fork.merged_hugepage_regions() > 0);
+}
+
+TEST_CASE("Forks reuse pooled VMs", "[Fork]")
+{
+	const auto binary = build_and_load(R"M(
+int main() {
+}
+
+static int value = 0;
+extern int get_value() {
+	value ++;
+	return value;
+})M");
+
+	tinykvm::Machine machine { binary, { .max_mem = MAX_MEMORY } };
+	machine.setup_linux({"fork"}, env);
+	machine.run(4.0f);
+	machine.prepare_copy_on_write();
+
+	const tinykvm::MachineOptions options {
+		.max_mem = MAX_MEMORY,
+		.max_cow_mem = MAX_COWMEM,
+		.vcpu_pool_size = 2,
+	};
+	auto funcaddr = machine.address_of("get_value");
+	REQUIRE(funcaddr != 0x0);
+
+	// Every fork after the first one reuses a pooled VM and vCPU,
+	// and must not see any memory from the previous fork.
+	for (int i = 0; i < 20; i++) {
+		auto fork = tinykvm::Machine { machine, options };
+
+		fork.timed_vmcall(funcaddr, 4.0f);
+		REQUIRE(fork.return_value() == 1);
+		fork.timed_vmcall(funcaddr, 4.0f);
+		REQUIRE(fork.return_value() == 2);
+	}
+}
+
+TEST_CASE("Fork arguments through the argument arena", "[Fork]")
+{
+	const auto binary = build_and_load(R"M(
+int main() {
+}
+extern long sum_bytes(const char* data, unsigned long len) {
+	long sum = 0;
+	for (unsigned long i = 0; i < len; i++)
+		sum += data[i];
+	return sum;
+}
+extern unsigned long where(const char* str) {
+	return (unsigned long)str;
+})M");
+
+	tinykvm::Machine machine { binary, { .max_mem = MAX_MEMORY } };
+	machine.setup_linux({"fork"}, env);
+	machine.run(4.0f);
+	// Two forks may use the arena, one slot each
+	machine.prepare_argument_arena(65536, 2);
+	REQUIRE(machine.has_argument_arena());
+	machine.prepare_copy_on_write(0);
+
+	const tinykvm::MachineOptions options {
+		.max_mem = MAX_MEMORY, .max_cow_mem = MAX_COWMEM
+	};
+	std::vector<std::unique_ptr<tinykvm::Machine>> forks;
+	for (int i = 0; i < 3; i++)
+		forks.emplace_back(new tinykvm::Machine{machine, options});
+
+	const std::string payload(16384, '\x01');
+	for (int i = 0; i < 3; i++)
+	{
+		auto& fork = *forks.at(i);
+		for (int j = 0; j < 4; j++)
+		{
+			fork.timed_vmcall(fork.address_of("sum_bytes"), 4.0f,
+				tinykvm::ArgumentBuffer{payload});
+			REQUIRE(fork.return_value() == (long)payload.size());
+
+			fork.timed_vmcall(fork.address_of("where"), 4.0f, payload);
+			const uint64_t addr = fork.return_value();
+			// The third fork falls back to the stack
+			REQUIRE((addr >= machine.max_address() - (2ul << 20)) == (i < 2));
+			REQUIRE(fork.memory_at(addr, 3) == std::string_view("\x01\x01\x01"));
+		}
+		fork.reset_to(machine, options);
+	}
+	// A new fork takes the slot of a destroyed one
+	forks.at(0).reset();
+	tinykvm::Machine fork { machine, options };
+	fork.timed_vmcall(fork.address_of("where"), 4.0f, std::string("Hello"));
+	REQUIRE(uint64_t(fork.return_value()) >= machine.max_address() - (2ul << 20));
+}
+
+TEST_CASE("Fork from a master shared through a memfd", "[Fork]")
+{
+	const auto binary = build_and_load(R"M(
+static int value = 0;
+int main() {
+	value = 1234;
+}
+extern long get_value() {
+	value += 1;
+	return value;
+})M");
+
+	tinykvm::Machine machine { binary, { .max_mem = MAX_MEMORY } };
+	machine.setup_linux({"fork"}, env);
+	machine.run(4.0f);
+	machine.prepare_copy_on_write(0);
+
+	const int fd = machine.share_main_memory();
+	REQUIRE(fd >= 0);
+	REQUIRE(machine.share_main_memory() == fd);
+
+	// Attach a second master to the sealed memory, as another process would
+	tinykvm::Machine attached { binary, {
+		.max_mem = MAX_MEMORY,
+		.snapshot_file = "/proc/self/fd/" + std::to_string(fd),
+		.snapshot_mode = tinykvm::MachineOptions::SnapshotMode::Open
+	} };
+	REQUIRE(attached.has_snapshot_state());
+	REQUIRE(attached.is_forkable());
+	REQUIRE(attached.address_of("get_value") == machine.address_of("get_value"));
+
+	for (auto* master : { &machine, &attached })
+	{
+		auto fork = tinykvm::Machine { *master, {
+			.max_mem = MAX_MEMORY, .max_cow_mem = MAX_COWMEM
+		} };
+		for (int i = 0; i < 4; i++) {
+			fork.vmcall("get_value");
+			REQUIRE(fork.return_value() == 1235u);
+			fork.reset_to(*master, {
+				.max_mem = MAX_MEMORY, .max_cow_mem = MAX_COWMEM
+			});
+		}
+	}
+}
+
 TEST_CASE("Fork sanity checks w/crashes", "[Fork]")
 {
 	const auto binary = build_and_load(R"M(
@@ -76,6 +76,44 @@ extern long get_mmap(int *z) {
 	}
 }
 
+TEST_CASE("Reset VM in the background", "[Reset]")
+{
+	const auto binary = build_and_load(R"M(
+static int a = 0;
+int main() {
+}
+extern long get_a() {
+	int ta = a;
+	a = 333;
+	return ta;
+})M");
+
+	tinykvm::Machine machine { binary, { .max_mem = MAX_MEMORY } };
+	machine.setup_linux({"reset"}, env);
+	machine.run(4.0f);
+	machine.prepare_copy_on_write(0);
+
+	const tinykvm::MachineOptions options {
+		.max_mem = MAX_MEMORY, .max_cow_mem = MAX_COWMEM
+	};
+	auto fork = tinykvm::Machine { machine, options };
+	REQUIRE(!fork.has_background_reset());
+
+	for (size_t i = 0; i < 15; i++)
+	{
+		fork.timed_vmcall(fork.address_of("get_a"), 2.0f);
+		REQUIRE(fork.return_value() == 0);
+
+		fork.reset_to_in_background(machine, options);
+		REQUIRE(fork.has_background_reset());
+		fork.wait_for_reset();
+		REQUIRE(!fork.has_background_reset());
+	}
+	// A pending reset is waited for on destruction
+	fork.timed_vmcall(fork.address_of("get_a"), 2.0f);
+	fork.reset_to_in_background(machine, options);
+}
+
 TEST_CASE("Execute function in VM (crash recovery)", "[Reset]")
 {
 	const auto binary = build_and_load(R"M(
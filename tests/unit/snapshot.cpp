@@ -0,0 +1,266 @@
+#include <catch2/catch_test_macros.hpp>
+
+#include <tinykvm/machine.hpp>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+extern std::vector<uint8_t> build_and_load(const std::string& code);
+static const uint64_t MAX_MEMORY = 32ul << 20; /* 32MB */
+static const std::vector<std::string> env {
+	"LC_TYPE=C", "LC_ALL=C", "USER=root"
+};
+
+TEST_CASE("Initialize KVM", "[Initialize]")
+{
+	// Create KVM file descriptors etc.
+	tinykvm::Machine::init();
+}
+
+TEST_CASE("Stack delta snapshots on a base snapshot", "[Snapshot]")
+{
+	const auto binary = build_and_load(R"M(
+static long value = 0;
+int main() {
+	value = 1;
+}
+extern long get_value() {
+	return value;
+}
+extern void set_value(long v) {
+	value = v;
+}
+long host_value[512] __attribute__((aligned(4096)));
+extern long get_host_value() {
+	return host_value[0];
+})M");
+	const std::string base  = "/tmp/tinykvm_snapshot_base.bin";
+	const std::string delta1 = "/tmp/tinykvm_snapshot_delta1.bin";
+	const std::string delta2 = "/tmp/tinykvm_snapshot_delta2.bin";
+	const std::string delta3 = "/tmp/tinykvm_snapshot_delta3.bin";
+	{
+		tinykvm::Machine machine { binary, {
+			.max_mem = MAX_MEMORY,
+			.snapshot_file = base,
+			.snapshot_mode = tinykvm::MachineOptions::SnapshotMode::Create
+		} };
+		machine.setup_linux({"snapshot"}, env);
+		machine.run(4.0f);
+		machine.save_snapshot_state_now();
+	}
+	auto load = [&] (std::vector<std::string> deltas) {
+		return std::make_unique<tinykvm::Machine>(binary, tinykvm::MachineOptions{
+			.max_mem = MAX_MEMORY,
+			.snapshot_file = base,
+			.snapshot_mode = tinykvm::MachineOptions::SnapshotMode::Open,
+			.snapshot_deltas = std::move(deltas)
+		});
+	};
+	{
+		auto machine = load({});
+		REQUIRE(machine->has_snapshot_state());
+		machine->vmcall("set_value", 2);
+		machine->save_snapshot_delta(delta1);
+	}
+	// Only the pages that differ from the base are in the delta
+	struct stat st;
+	REQUIRE(stat(delta1.c_str(), &st) == 0);
+	REQUIRE(uint64_t(st.st_blocks) * 512 < MAX_MEMORY / 4);
+	{
+		auto machine = load({delta1});
+		machine->vmcall("get_value");
+		REQUIRE(machine->return_value() == 2u);
+		machine->vmcall("set_value", 3);
+		machine->save_snapshot_delta(delta2);
+	}
+	{
+		auto machine = load({delta1, delta2});
+		machine->vmcall("get_value");
+		REQUIRE(machine->return_value() == 3u);
+	}
+	{
+		auto machine = load({});
+		machine->vmcall("get_value");
+		REQUIRE(machine->return_value() == 1u);
+	}
+	// Pages that only the host has written to are in the delta too
+	{
+		auto machine = load({});
+		const long value = 0x12345678;
+		machine->copy_to_guest(machine->address_of("host_value"), &value, sizeof(value));
+		machine->save_snapshot_delta(delta3);
+	}
+	{
+		auto machine = load({delta3});
+		machine->vmcall("get_host_value");
+		REQUIRE(machine->return_value() == 0x12345678u);
+	}
+	unlink(base.c_str());
+	unlink(delta1.c_str());
+	unlink(delta2.c_str());
+	unlink(delta3.c_str());
+}
+
+TEST_CASE("Prefetch recorded pages when loading a snapshot", "[Snapshot]")
+{
+	const auto binary = build_and_load(R"M(
+static char buffer[1024 * 1024];
+int main() {
+	for (unsigned i = 0; i < sizeof(buffer); i += 4096)
+		buffer[i] = 1;
+}
+extern long get_value() {
+	long sum = 0;
+	for (unsigned i = 0; i < sizeof(buffer); i += 4096)
+		sum += buffer[i];
+	return sum;
+})M");
+	const std::string filename = "/tmp/tinykvm_snapshot_prefetch.bin";
+	{
+		tinykvm::Machine machine { binary, {
+			.max_mem = MAX_MEMORY,
+			.snapshot_file = filename,
+			.snapshot_mode = tinykvm::MachineOptions::SnapshotMode::Create
+		} };
+		machine.setup_linux({"snapshot"}, env);
+		machine.run(4.0f);
+		machine.save_snapshot_state_now(machine.get_accessed_pages());
+	}
+	for (const bool prefetch : { true, false })
+	{
+		tinykvm::Machine machine { binary, {
+			.max_mem = MAX_MEMORY,
+			.snapshot_file = filename,
+			.snapshot_mode = tinykvm::MachineOptions::SnapshotMode::Open,
+			.snapshot_prefetch = prefetch
+		} };
+		machine.vmcall("get_value");
+		REQUIRE(machine.return_value() == 256);
+	}
+	unlink(filename.c_str());
+}
+
+TEST_CASE("Load a compressed snapshot", "[Snapshot]")
+{
+	const auto binary = build_and_load(R"M(
+static long value = 0;
+static char buffer[256 * 1024];
+int main() {
+	value = 1;
+	for (unsigned i = 0; i < sizeof(buffer); i++)
+		buffer[i] = i % 7;
+}
+extern long get_value() {
+	long sum = value;
+	for (unsigned i = 0; i < sizeof(buffer); i++)
+		sum += buffer[i];
+	return sum;
+})M");
+	const std::string filename = "/tmp/tinykvm_snapshot_compressed.bin";
+	long expected = 0;
+	{
+		tinykvm::Machine machine { binary, { .max_mem = MAX_MEMORY } };
+		machine.setup_linux({"snapshot"}, env);
+		machine.run(4.0f);
+		machine.vmcall("get_value");
+		expected = machine.return_value();
+		machine.save_compressed_snapshot(filename);
+	}
+	// Zero pages take no space, and the rest is compressed
+	struct stat st;
+	REQUIRE(stat(filename.c_str(), &st) == 0);
+	REQUIRE(uint64_t(st.st_size) < MAX_MEMORY / 4);
+
+	tinykvm::Machine machine { binary, {
+		.max_mem = MAX_MEMORY,
+		.snapshot_file = filename,
+		.snapshot_mode = tinykvm::MachineOptions::SnapshotMode::Open
+	} };
+	REQUIRE(machine.has_snapshot_state());
+	machine.vmcall("get_value");
+	REQUIRE(machine.return_value() == expected);
+
+	// Forks read their pages from the master
+	machine.prepare_copy_on_write(0);
+	auto fork = tinykvm::Machine { machine, { .max_mem = MAX_MEMORY, .max_cow_mem = 8ul << 20 } };
+	fork.vmcall("get_value");
+	REQUIRE(fork.return_value() == expected);
+
+	// A snapshot written with an unknown codec is refused
+	const uint32_t codec = 0xC0DEC;
+	const int fd = open(filename.c_str(), O_WRONLY);
+	REQUIRE(fd >= 0);
+	REQUIRE(pwrite(fd, &codec, sizeof(codec), 8) == sizeof(codec));
+	close(fd);
+	REQUIRE_THROWS(tinykvm::Machine { binary, {
+		.max_mem = MAX_MEMORY,
+		.snapshot_file = filename,
+		.snapshot_mode = tinykvm::MachineOptions::SnapshotMode::Open
+	} });
+	unlink(filename.c_str());
+}
+
+TEST_CASE("Restore file-backed mappings from a snapshot", "[Snapshot]")
+{
+	const auto binary = build_and_load(R"M(
+#include <fcntl.h>
+#include <sys/mman.h>
+static const unsigned char* data = 0;
+static const unsigned long size = 8ul << 20;
+int main() {
+	int fd = open("/tmp/tinykvm_snapshot_mapped.dat", O_RDONLY);
+	data = mmap(0, size, PROT_READ, MAP_PRIVATE, fd, 0);
+	if (data == MAP_FAILED) return 1;
+	close(fd);
+}
+extern long get_value() {
+	long sum = 0;
+	for (unsigned long i = 0; i < size; i += 4096)
+		sum += data[i];
+	return sum;
+})M");
+	const std::string datafile = "/tmp/tinykvm_snapshot_mapped.dat";
+	const std::string filename = "/tmp/tinykvm_snapshot_mapped.bin";
+	{
+		std::vector<uint8_t> contents(8ul << 20);
+		for (size_t i = 0; i < contents.size(); i += 4096)
+			contents[i] = (i / 4096) % 5;
+		FILE* f = fopen(datafile.c_str(), "wb");
+		REQUIRE(f != nullptr);
+		fwrite(contents.data(), 1, contents.size(), f);
+		fclose(f);
+	}
+	long expected = 0;
+	{
+		tinykvm::Machine machine { binary, {
+			.max_mem = MAX_MEMORY,
+			.mmap_backed_files = true,
+			.snapshot_file = filename,
+			.snapshot_mode = tinykvm::MachineOptions::SnapshotMode::Create
+		} };
+		machine.fds().set_open_readable_callback(
+		[&] (std::string& path) -> bool {
+			return path == datafile;
+		});
+		machine.setup_linux({"snapshot"}, env);
+		machine.run(4.0f);
+		REQUIRE(machine.return_value() == 0);
+		REQUIRE(!machine.main_memory().mmap_ranges.empty());
+		machine.vmcall("get_value");
+		expected = machine.return_value();
+		machine.save_snapshot_state_now();
+	}
+
+	tinykvm::Machine machine { binary, {
+		.max_mem = MAX_MEMORY,
+		.mmap_backed_files = true,
+		.snapshot_file = filename,
+		.snapshot_mode = tinykvm::MachineOptions::SnapshotMode::Open
+	} };
+	REQUIRE(machine.has_snapshot_state());
+	REQUIRE(!machine.main_memory().mmap_ranges.empty());
+	REQUIRE(!machine.has_snapshot_remote());
+	machine.vmcall("get_value");
+	REQUIRE(machine.return_value() == expected);
+	unlink(filename.c_str());
+	unlink(datafile.c_str());
+}
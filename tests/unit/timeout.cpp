@@ -27,36 +27,46 @@ int main() {
 	while (1);
 })M");
 
-	std::vector<std::thread> threads;
-
-	for (size_t i = 0; i < 100; i++)
+	// POSIX timers, and the shared watchdog thread
+	for (const bool watchdog : { false, true })
 	{
-		// Good program
-		threads.push_back(std::thread([&] {
-			tinykvm::Machine machine { good_binary, { .max_mem = MAX_MEMORY } };
-			machine.setup_linux({"timeout"}, env);
-			// This must *NOT* cause a timeout exception
-			try {
-				machine.run(1.0f);
-			} catch (const tinykvm::MachineTimeoutException& e) {
-				throw std::runtime_error("Timeout in good program");
-			}
-		}));
-		// Bad program
-		threads.push_back(std::thread([&] {
-			tinykvm::Machine machine { bad_binary, { .max_mem = MAX_MEMORY } };
-			machine.setup_linux({"timeout"}, env);
-			// This must cause a timeout exception
-			try {
-				machine.run(1.0f);
-			} catch (const tinykvm::MachineTimeoutException& e) {
-				return;
-			}
-			throw std::runtime_error("No timeout");
-		}));
+		const tinykvm::MachineOptions options {
+			.max_mem = MAX_MEMORY,
+			.watchdog_timeouts = watchdog,
+		};
+		std::vector<std::thread> threads;
+
+		for (size_t i = 0; i < 100; i++)
+		{
+			// Good program
+			threads.push_back(std::thread([&] {
+				tinykvm::Machine machine { good_binary, options };
+				machine.setup_linux({"timeout"}, env);
+				// This must *NOT* cause a timeout exception
+				try {
+					machine.run(1.0f);
+				} catch (const tinykvm::MachineTimeoutException& e) {
+					throw std::runtime_error("Timeout in good program");
+				}
+			}));
+			// Bad program
+			threads.push_back(std::thread([&] {
+				tinykvm::Machine machine { bad_binary, options };
+				machine.setup_linux({"timeout"}, env);
+				// This must cause a timeout exception, repeatedly
+				for (int j = 0; j < 2; j++) {
+					try {
+						machine.run(1.0f);
+					} catch (const tinykvm::MachineTimeoutException& e) {
+						continue;
+					}
+					throw std::runtime_error("No timeout");
+				}
+			}));
+		}
+		for (auto& thread : threads)
+			thread.join();
 	}
-	for (auto& thread : threads)
-		thread.join();
 }
 
 TEST_CASE("Multiple timeouts in Linux system call", "[Timeout]")
@@ -93,3 +103,74 @@ int main() {
 	for (auto& thread : threads)
 		thread.join();
 }
+
+TEST_CASE("Local APIC timer timeouts", "[Timeout]")
+{
+	const auto binary = build_and_load(R"M(
+int main() {
+	return 0;
+}
+extern void loop_forever() {
+	while (1);
+}
+extern void loop_masked() {
+	asm volatile("cli");
+	while (1);
+})M");
+	const tinykvm::MachineOptions options {
+		.max_mem = MAX_MEMORY,
+		.lapic_timeouts = true,
+	};
+	tinykvm::Machine machine { binary, options };
+	machine.setup_linux({"timeout"}, env);
+	machine.run(1.0f);
+
+	// The local APIC timer interrupts the guest
+	for (int i = 0; i < 10; i++) {
+		REQUIRE_THROWS_AS(
+			machine.timed_vmcall(machine.address_of("loop_forever"), 0.01f),
+			tinykvm::MachineTimeoutException);
+	}
+	// The watchdog catches guests that mask interrupts
+	REQUIRE_THROWS_AS(
+		machine.timed_vmcall(machine.address_of("loop_masked"), 0.01f),
+		tinykvm::MachineTimeoutException);
+}
+
+TEST_CASE("Pooled vCPUs after local APIC timer timeouts", "[Timeout]")
+{
+	const auto binary = build_and_load(R"M(
+int main() {
+	return 0;
+}
+static int value = 0;
+extern int get_value() {
+	value ++;
+	return value;
+}
+extern void loop_forever() {
+	while (1);
+})M");
+	tinykvm::Machine machine { binary, { .max_mem = MAX_MEMORY } };
+	machine.setup_linux({"timeout"}, env);
+	machine.run(1.0f);
+	machine.prepare_copy_on_write();
+
+	const tinykvm::MachineOptions options {
+		.max_mem = MAX_MEMORY,
+		.max_cow_mem = MAX_COWMEM,
+		.vcpu_pool_size = 1,
+		.lapic_timeouts = true,
+	};
+	// Every fork after the first one reuses the vCPU of a fork
+	// that timed out, which must not leak timer state into it.
+	for (int i = 0; i < 10; i++) {
+		auto fork = tinykvm::Machine { machine, options };
+
+		fork.timed_vmcall(machine.address_of("get_value"), 1.0f);
+		REQUIRE(fork.return_value() == 1);
+		REQUIRE_THROWS_AS(
+			fork.timed_vmcall(machine.address_of("loop_forever"), 0.01f),
+			tinykvm::MachineTimeoutException);
+	}
+}
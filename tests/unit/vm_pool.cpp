@@ -0,0 +1,121 @@
+#include <catch2/catch_test_macros.hpp>
+
+#include <tinykvm/vm_pool.hpp>
+extern std::vector<uint8_t> build_and_load(const std::string& code);
+static const uint64_t MAX_MEMORY = 8ul << 20; /* 8MB */
+static const uint64_t MAX_COWMEM = 1ul << 20; /* 1MB */
+static const std::vector<std::string> env {
+	"LC_TYPE=C", "LC_ALL=C", "USER=root"
+};
+
+TEST_CASE("Initialize KVM", "[Initialize]")
+{
+	// Create KVM file descriptors etc.
+	tinykvm::Machine::init();
+}
+
+TEST_CASE("Requests on pooled forks", "[VMPool]")
+{
+	const auto binary = build_and_load(R"M(
+int main() {
+}
+
+static int value = 0;
+extern int get_value(int add) {
+	value += add;
+	return value;
+})M");
+
+	tinykvm::Machine machine1 { binary, { .max_mem = MAX_MEMORY } };
+	machine1.setup_linux({"vm_pool"}, env);
+	machine1.run(4.0f);
+	machine1.prepare_copy_on_write();
+
+	tinykvm::Machine machine2 { binary, { .max_mem = MAX_MEMORY } };
+	machine2.setup_linux({"vm_pool"}, env);
+	machine2.run(4.0f);
+	machine2.prepare_copy_on_write();
+
+	const auto funcaddr = machine1.address_of("get_value");
+	REQUIRE(funcaddr != 0x0);
+
+	tinykvm::VMPool pool {{
+		.num_workers = 2,
+		.forks_per_master = 2,
+		.pin_workers = false,
+		.fork_options = { .max_mem = MAX_MEMORY, .max_cow_mem = MAX_COWMEM },
+	}};
+	REQUIRE(pool.num_workers() == 2);
+
+	std::vector<std::future<long>> results;
+	for (int i = 0; i < 100; i++) {
+		auto& master = (i % 2 == 0) ? machine1 : machine2;
+		results.push_back(pool.enqueue(master, [=] (tinykvm::Machine& vm) {
+			vm.timed_vmcall(funcaddr, 4.0f, i);
+			return vm.return_value();
+		}));
+	}
+	// Every request starts from a freshly reset fork
+	for (int i = 0; i < 100; i++) {
+		REQUIRE(results[i].get() == i);
+	}
+
+	// Exceptions are forwarded to the requester
+	auto failed = pool.enqueue(machine1, [] (tinykvm::Machine&) {
+		throw std::runtime_error("Request failed");
+	});
+	REQUIRE_THROWS_AS(failed.get(), std::runtime_error);
+
+	pool.remove_master(machine1);
+	pool.remove_master(machine2);
+	REQUIRE(pool.memory_usage() == 0);
+	// Every request was followed by a reset
+	REQUIRE(pool.reset_time() > 0);
+}
+
+TEST_CASE("Pooled forks are evicted over the memory budget", "[VMPool]")
+{
+	const auto binary = build_and_load(R"M(
+#include <string.h>
+int main() {
+}
+
+static char buffer[256 * 1024];
+extern void touch() {
+	memset(buffer, 1, sizeof(buffer));
+})M");
+
+	std::vector<std::unique_ptr<tinykvm::Machine>> masters;
+	for (int i = 0; i < 4; i++) {
+		masters.emplace_back(new tinykvm::Machine { binary, { .max_mem = MAX_MEMORY } });
+		masters.back()->setup_linux({"vm_pool"}, env);
+		masters.back()->run(4.0f);
+		masters.back()->prepare_copy_on_write();
+	}
+	const auto funcaddr = masters.front()->address_of("touch");
+	REQUIRE(funcaddr != 0x0);
+
+	tinykvm::VMPool pool {{
+		.num_workers = 1,
+		.pin_workers = false,
+		.memory_budget = 512ul << 10,
+		.fork_options = {
+			.max_mem = MAX_MEMORY,
+			.max_cow_mem = MAX_COWMEM,
+			.reset_keep_all_work_memory = true,
+		},
+	}};
+
+	for (int round = 0; round < 3; round++) {
+		for (auto& master : masters) {
+			pool.enqueue(*master, [=] (tinykvm::Machine& vm) {
+				vm.timed_vmcall(funcaddr, 4.0f);
+			}).get();
+		}
+	}
+	REQUIRE(pool.evictions() > 0);
+
+	for (auto& master : masters)
+		pool.remove_master(*master);
+	REQUIRE(pool.memory_usage() == 0);
+}